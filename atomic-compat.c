@@ -28,6 +28,19 @@
 
 #include "atomic-compat.h"
 
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sched.h>
+#endif
+
 
 
 int32_t atomic_increment_32(int32_t *addr) {  
@@ -48,7 +61,7 @@ int32_t atomic_decrement_32(int32_t *addr) {
 #endif
 }
 
-int32_t atomic_compare_and_swap_32(int32_t oldval, int32_t newval, int32_t *addr) { 
+int atomic_compare_and_swap_32(int32_t oldval, int32_t newval, int32_t *addr) { 
 #ifdef USE_ATOMIC_BUILTINS
     return __sync_bool_compare_and_swap (addr, oldval, newval);
 #else
@@ -56,10 +69,168 @@ int32_t atomic_compare_and_swap_32(int32_t oldval, int32_t newval, int32_t *addr
 #endif
 }
 
+int atomic_compare_and_swap_64(int64_t oldval, int64_t newval, int64_t *addr) { 
+#ifdef USE_ATOMIC_BUILTINS
+    return __sync_bool_compare_and_swap (addr, oldval, newval);
+#else
+    return OSAtomicCompareAndSwap64Barrier(oldval, newval, addr); 
+#endif
+}
+
+int64_t atomic_read_64(int64_t *addr) {
+#ifdef USE_ATOMIC_BUILTINS
+    return __atomic_load_n (addr, __ATOMIC_ACQUIRE);
+#else
+    return OSAtomicAdd64Barrier(0, addr);
+#endif
+}
+
+int64_t atomic_or_64(int64_t bits, int64_t *addr) {
+#ifdef USE_ATOMIC_BUILTINS
+    return __sync_fetch_and_or (addr, bits);
+#else
+    int64_t old;
+    
+    do {
+        old = *addr;
+    } while (!OSAtomicCompareAndSwap64Barrier(old, old | bits, addr));
+    return old;
+#endif
+}
+
+int64_t atomic_swap_64(int64_t newval, int64_t *addr) {
+#ifdef USE_ATOMIC_BUILTINS
+    return __atomic_exchange_n (addr, newval, __ATOMIC_SEQ_CST);
+#else
+    int64_t old;
+    
+    do {
+        old = *addr;
+    } while (!OSAtomicCompareAndSwap64Barrier(old, newval, addr));
+    return old;
+#endif
+}
+
+int32_t atomic_swap_32(int32_t newval, int32_t *addr) {
+#ifdef USE_ATOMIC_BUILTINS
+    return __atomic_exchange_n (addr, newval, __ATOMIC_SEQ_CST);
+#else
+    int32_t old;
+    
+    do {
+        old = *addr;
+    } while (!OSAtomicCompareAndSwap32Barrier(old, newval, addr));
+    return old;
+#endif
+}
+
+
+void atomic_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// The futexes are not FUTEX_PRIVATE, since what is waited on may be shared with other processes.
+//
+void atomic_wait_while_equal(uint32_t *addr, uint32_t val, long timeout_usec) {
+#ifdef __linux__
+    struct timespec timeout;
+    
+    timeout.tv_sec = timeout_usec / 1000000;
+    timeout.tv_nsec = (timeout_usec % 1000000) * 1000;
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_usec ? &timeout : NULL, NULL, 0);
+#else
+    sched_yield();
+#endif
+}
+
+void atomic_wake_all(uint32_t *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// futex_waitv(2) is in Linux 5.16 and later.  Its timeout is absolute.
+//
+void atomic_wait_while_all_equal(uint32_t **addrs, uint32_t *vals, int n, long timeout_usec) {
+#if defined(__linux__) && defined(SYS_futex_waitv) && defined(FUTEX_32)
+    struct futex_waitv waiters[ATOMIC_WAIT_MAX];
+    struct timespec timeout;
+    int i;
+    
+    if (n > 1 && n <= ATOMIC_WAIT_MAX) {
+        for (i = 0; i < n; i++) {
+            waiters[i].val = vals[i];
+            waiters[i].uaddr = (uintptr_t)addrs[i];
+            waiters[i].flags = FUTEX_32;
+            waiters[i].__reserved = 0;
+        }
+        if (timeout_usec) {
+            clock_gettime(CLOCK_MONOTONIC, &timeout);
+            timeout.tv_sec += timeout_usec / 1000000;
+            timeout.tv_nsec += (timeout_usec % 1000000) * 1000;
+            if (timeout.tv_nsec >= 1000000000) {
+                timeout.tv_sec++;
+                timeout.tv_nsec -= 1000000000;
+            }
+        }
+        if (syscall(SYS_futex_waitv, waiters, n, 0, timeout_usec ? &timeout : NULL, CLOCK_MONOTONIC) != -1 ||
+            errno != ENOSYS)
+            return;
+    }
+#endif
+    
+    if (n == 1)
+        atomic_wait_while_equal(addrs[0], vals[0], timeout_usec);
+    else if (n > 1)
+        atomic_wait_while_equal(addrs[0], vals[0], (timeout_usec && timeout_usec < 1000) ? timeout_usec : 1000);
+}
+
+
+#define ticket_entry(ticket, pid) (((uint64_t)(ticket) << 32) | (uint32_t)(pid))
 
 void atomic_spin_lock_lock(atomic_lock *lock) {
 #ifdef USE_ATOMIC_BUILTINS    
-    __sync_lock_test_and_set (lock, 1);
+    uint32_t ticket = __sync_fetch_and_add(&lock->next_ticket, 1);
+    uint32_t serving, last_serving = ticket;
+    uint64_t entry;
+    pid_t pid;
+    int spins = 0;
+    
+    __atomic_store_n(&lock->tickets[ticket % ATOMIC_LOCK_TICKETS], ticket_entry(ticket, getpid()), __ATOMIC_RELEASE);
+    if (*(volatile uint32_t *)&lock->now_serving == ticket)
+        return;
+    
+    __sync_fetch_and_add(&lock->contended, 1);
+    while ((serving = *(volatile uint32_t *)&lock->now_serving) != ticket) {
+        if (spins++ < ATOMIC_LOCK_SPINS) {
+            atomic_pause();
+            continue;
+        }
+        // The lock lives in memory shared between processes, so a process that dies holding it, or after taking a
+        // ticket but before its turn came, would leave everybody behind it waiting forever.  If the line hasn't
+        // moved while we slept, and the process that took the ticket at the front of it is gone, skip the ticket.
+        // A holder that is still alive is always waited for.  Only one of the waiters wins the compare and swap, so
+        // each dead ticket is skipped once.
+        if (serving != last_serving) {
+            last_serving = serving;
+        } else {
+            entry = __atomic_load_n(&lock->tickets[serving % ATOMIC_LOCK_TICKETS], __ATOMIC_ACQUIRE);
+            if (entry >> 32 == serving && (pid = (pid_t)(uint32_t)entry) != 0 && kill(pid, 0) == -1 &&
+                errno == ESRCH) {
+                if (__sync_bool_compare_and_swap(&lock->now_serving, serving, serving + 1))
+                    atomic_wake_all(&lock->now_serving);
+                continue;
+            }
+        }
+        // If the holder has gone by the time we are asleep, the futex sees that now_serving has changed.
+        __sync_fetch_and_add(&lock->sleepers, 1);
+        __sync_fetch_and_add(&lock->slept, 1);
+        atomic_wait_while_equal(&lock->now_serving, serving, ATOMIC_LOCK_SLEEP_USEC);
+        __sync_fetch_and_sub(&lock->sleepers, 1);
+    }
+    __sync_synchronize();
 #else
     OSSpinLockLock(lock);
 #endif
@@ -67,10 +238,23 @@ void atomic_spin_lock_lock(atomic_lock *lock) {
 
 void atomic_spin_lock_unlock(atomic_lock *lock) {
 #ifdef USE_ATOMIC_BUILTINS    
-    __sync_lock_release (lock);
-
+    __sync_fetch_and_add(&lock->now_serving, 1);
+    
+    // Everybody asleep wakes up, but only the one whose turn it is keeps the lock.
+    if (*(volatile uint32_t *)&lock->sleepers)
+        atomic_wake_all(&lock->now_serving);
 #else
     OSSpinLockUnlock(lock);
 #endif
     
 }
+
+void atomic_spin_lock_stats(atomic_lock *lock, uint32_t *acquired, uint32_t *contended, uint32_t *slept) {
+#ifdef USE_ATOMIC_BUILTINS    
+    *acquired = lock->now_serving;
+    *contended = lock->contended;
+    *slept = lock->slept;
+#else
+    *acquired = *contended = *slept = 0;
+#endif
+}
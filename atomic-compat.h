@@ -32,7 +32,33 @@
 
 #include <stdint.h>
 
-typedef int32_t atomic_lock;
+// How many of the most recent tickets a lock remembers the process IDs of.
+//
+#define ATOMIC_LOCK_TICKETS 16
+
+// A ticket lock, which can be used between processes if it is in shared memory.  All zeroes is unlocked.
+// Waiters spin for a little while, and then sleep (on Linux, on a futex; elsewhere they just yield).
+// The last three fields are only for finding out how much contention there is.
+//
+typedef struct atomic_lock {
+    uint32_t next_ticket;                   // the ticket for the next thread to want the lock
+    uint32_t now_serving;                   // the ticket of the thread that has the lock, or will have it next
+    uint64_t tickets[ATOMIC_LOCK_TICKETS];  // each ticket in its place mod ATOMIC_LOCK_TICKETS, with the process ID
+                                            // of whoever took it in the lower half
+    uint32_t sleepers;                      // threads asleep waiting for now_serving to change
+    uint32_t contended;                     // acquisitions that had to wait
+    uint32_t slept;                         // times a waiter went to sleep
+} atomic_lock;
+
+// How many times to check the lock before going to sleep.
+//
+#define ATOMIC_LOCK_SPINS 200
+
+// How long a waiter sleeps at a time.  If the ticket being served hasn't changed when it wakes, and the process
+// that took that ticket is gone, the ticket is skipped.  A ticket whose place has been taken by a later one since,
+// because the line is longer than ATOMIC_LOCK_TICKETS, is never skipped, since who took it isn't known.
+//
+#define ATOMIC_LOCK_SLEEP_USEC 10000
 
 #else
 
@@ -48,11 +74,52 @@ void atomic_spin_lock_lock(atomic_lock *lock);
 
 void atomic_spin_lock_unlock(atomic_lock *lock);
 
+// The number of times the lock has been acquired, how many of those had to wait, and how many times waiters slept.
+// Zeroes where this isn't kept track of.
+//
+void atomic_spin_lock_stats(atomic_lock *lock, uint32_t *acquired, uint32_t *contended, uint32_t *slept);
+
 int32_t atomic_increment_32(int32_t *addr);
 
 int32_t atomic_decrement_32(int32_t *addr);
 
-int32_t atomic_compare_and_swap_32(int32_t oldval, int32_t newval, int32_t *addr);
+int atomic_compare_and_swap_32(int32_t oldval, int32_t newval, int32_t *addr);
+
+int atomic_compare_and_swap_64(int64_t oldval, int64_t newval, int64_t *addr);
+
+// Reads all 64 bits at once, even where a plain 64-bit load might be split in two.
+//
+int64_t atomic_read_64(int64_t *addr);
+
+// These return what was there before.
+//
+int64_t atomic_or_64(int64_t bits, int64_t *addr);
+
+int64_t atomic_swap_64(int64_t newval, int64_t *addr);
+
+int32_t atomic_swap_32(int32_t newval, int32_t *addr);
+
+// For spinning on something another thread is about to change.
+//
+void atomic_pause();
+
+// Sleep until *addr is no longer val, or for at most timeout_usec microseconds, if that isn't 0.  May return early
+// for no reason, so check again.  Where there are no futexes, this just yields.
+//
+void atomic_wait_while_equal(uint32_t *addr, uint32_t val, long timeout_usec);
+
+// Wake everybody waiting in atomic_wait_while_equal() on addr.
+//
+void atomic_wake_all(uint32_t *addr);
+
+// Sleep until any of the n words *addrs[i] is no longer vals[i], or for at most timeout_usec microseconds, if that
+// isn't 0.  May return early for no reason, so check again.  Where the kernel can't wait on more than one word at
+// once, or there are more than ATOMIC_WAIT_MAX of them, this sleeps on the first one for a millisecond at most.
+// Waiters are woken by atomic_wake_all() on whichever word changed.
+//
+#define ATOMIC_WAIT_MAX 128
+
+void atomic_wait_while_all_equal(uint32_t **addrs, uint32_t *vals, int n, long timeout_usec);
 
 
 
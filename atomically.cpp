@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h> // for getpid(), fork()
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stm.hpp"
+
+// Tests of stm::atomically(), in the manner of features.c.  Each test runs in processes of its own, on a segment
+// of its own, and checks what they did.  Run stmtest4 with no arguments, or with the names of the tests to run.
+// The tests are run with each fault engine there is, and print a line for each check.  stmtest4 exits with the
+// number that failed.
+
+
+#define n_pages 16
+#define SEGSIZE (n_pages * 4096)
+#define page_word(b, p) ((b)[(p) * 512])     // the first long of page p
+
+static int failures;
+static const char *engine_name;             // the fault engine the tests are running with
+
+static void check(const char *test, const char *what, int ok) {
+    printf("%s: %s: %s: %s\n", engine_name, test, what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+// Start a test with a new segment, with nothing left from earlier runs.
+//
+static void new_segment_file(const char *filename) {
+    char metadata_filename[256];
+
+    snprintf(metadata_filename, sizeof(metadata_filename), "%s.metadata", filename);
+    unlink(filename);
+    unlink(metadata_filename);
+}
+
+static struct shared_segment *open_segment(const char *filename) {
+    struct shared_segment *seg;
+
+    if ((seg = stm_open_shared_segment(const_cast<char *>(filename), SEGSIZE, NULL, PROT_NONE)) == NULL) {
+        fprintf(stderr, "can't open %s: stm_errno %d\n", filename, stm_errno());
+        exit(-1);
+    }
+    return seg;
+}
+
+// A word outside the segments, shared by the processes of a test, so that they can take turns.  It is 0 as each
+// test's processes start.
+//
+static volatile long *turns;
+
+static void wait_for_turn(long turn) {
+    while (*turns != turn)
+        sched_yield();
+}
+
+// Run fn(b, i) in each of n new processes, with b the base of the segment, and return how many of them failed.
+//
+static int run_processes(int n, const char *filename, int (*fn)(volatile long *b, int i)) {
+    int i, status, failed = 0;
+    pid_t pid;
+
+    *turns = 0;
+    fflush(stdout);
+    for (i = 0; i < n; i++) {
+        if ((pid = fork()) == 0)
+            _exit(fn((volatile long *)stm_segment_base(open_segment(filename)), i));
+        if (pid < 0) {
+            perror("fork");
+            exit(-1);
+        }
+    }
+
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    return failed;
+}
+
+// Process 1 of a test changes page 1 each time process 0 has got as far as it should in a transaction, and waits
+// for it to be told to.  It does that times times.
+//
+static int change_page_1(volatile long *b, int times) {
+    int k;
+
+    for (k = 1; k <= times; k++) {
+        wait_for_turn(2 * k - 1);
+        stm::atomically([&] { page_word(b, 1) += 1; });
+        *turns = 2 * k;
+    }
+    return 0;
+}
+
+
+//
+// Retries.  Process 0's transactions read page 1, and the first attempt of each waits for process 1 to change
+// it, so that it is aborted and run again.  What stm::atomically() returns should come from the attempt that
+// committed:  a value read from page 1, and then a reference to a word picked by what was in page 1.
+//
+
+static int retrying(volatile long *b, int i) {
+    volatile int attempts = 0;
+    long value;
+
+    if (i == 1)
+        return change_page_1(b, 2);
+
+    value = stm::atomically([&] {
+        long v = page_word(b, 1);
+        if (attempts++ == 0) {
+            *turns = 1;
+            wait_for_turn(2);
+        }
+        page_word(b, 2) = v;
+        return v;
+    });
+    if (!(attempts == 2 && value == 1))
+        return 1;
+
+    attempts = 0;
+    volatile long &word = stm::atomically([&]() -> volatile long & {
+        volatile long &w = page_word(b, 3 + page_word(b, 1));
+        if (attempts++ == 0) {
+            *turns = 3;
+            wait_for_turn(4);
+        }
+        w = 1;
+        return w;
+    });
+    return !(attempts == 2 && &word == &page_word(b, 5));
+}
+
+static void test_retry() {
+    const char *filename = "/tmp/stmtest4-retry";
+
+    new_segment_file(filename);
+    check("retry", "value and reference from the attempt that committed", run_processes(2, filename, retrying) == 0);
+}
+
+
+//
+// Giving up.  The same, but process 1 changes page 1 every time, so a policy that allows only so many attempts
+// gives up, and stm::atomically() throws.
+//
+
+#define policy_attempts 3
+
+static int giving_up(volatile long *b, int i) {
+    volatile int attempts = 0;
+
+    if (i == 1)
+        return change_page_1(b, policy_attempts);
+
+    try {
+        stm::atomically<stm::policy<policy_attempts>>([&] {
+            page_word(b, 2) = page_word(b, 1);
+            attempts++;
+            *turns = 2 * attempts - 1;
+            wait_for_turn(2 * attempts);
+        });
+    } catch (stm::error &e) {
+        return !(e.code() == STM_RETRY_LIMIT_ERROR && attempts == policy_attempts);
+    }
+    return 1;
+}
+
+static void test_give_up() {
+    const char *filename = "/tmp/stmtest4-give-up";
+
+    new_segment_file(filename);
+    check("give_up", "policy gave up with STM_RETRY_LIMIT_ERROR", run_processes(2, filename, giving_up) == 0);
+}
+
+
+//
+// Exceptions.  A nested transaction writes pages 0 and 1 and throws, and the transaction around it catches the
+// exception and writes page 2.  With closed nesting, only the nested transaction is abandoned, and the outer one
+// commits without its writes.  Without it, the nested writes can't be undone, so the outer one fails.
+//
+
+static int nested_throw(volatile long *b) {
+    try {
+        stm::atomically([&] {
+            page_word(b, 0) = 1;
+            try {
+                stm::atomically([&] {
+                    page_word(b, 0) = 2;
+                    page_word(b, 1) = 2;
+                    throw 42;
+                });
+            } catch (int) {
+            }
+            page_word(b, 2) = 3;
+        });
+    } catch (stm::error &e) {
+        return e.code();
+    }
+    return 0;
+}
+
+static int closed_nesting(volatile long *b, int i) {
+    (void)i;    // there is only one
+    stm_set_closed_nesting(1);
+    return nested_throw(b) != 0 ||
+        stm::atomically([&] { return page_word(b, 0) == 1 && page_word(b, 1) == 0 && page_word(b, 2) == 3; }) == 0;
+}
+
+static int open_nesting(volatile long *b, int i) {
+    (void)i;    // there is only one
+    stm_set_closed_nesting(0);
+    return nested_throw(b) != STM_ABANDONED_ERROR ||
+        stm::atomically([&] { return page_word(b, 0) == 0 && page_word(b, 1) == 0 && page_word(b, 2) == 0; }) == 0;
+}
+
+static void test_exception() {
+    const char *filename = "/tmp/stmtest4-exception";
+
+    new_segment_file(filename);
+    stm_set_validation(STM_VALIDATE_VERSION_CLOCK);
+    check("exception", "only the nested transaction abandoned", run_processes(1, filename, closed_nesting) == 0);
+    stm_set_validation(STM_VALIDATE_TRANSACTION_IDS);
+
+    new_segment_file(filename);
+    check("exception", "without closed nesting, the outer transaction fails",
+          run_processes(1, filename, open_nesting) == 0);
+}
+
+
+struct {
+    const char *name;
+    void (*fn)();
+} tests[] = {
+    { "retry",          test_retry },
+    { "give_up",        test_give_up },
+    { "exception",      test_exception },
+};
+
+struct {
+    const char *name;
+    int engine;
+} engines[] = {
+    { "signal",         STM_ENGINE_SIGNAL },
+    { "userfaultfd",    STM_ENGINE_USERFAULTFD },
+};
+
+int main(int argc, const char * argv[]) {
+    int e, i, j;
+
+    stm_init(0x1);
+    turns = (volatile long *)mmap(0, sizeof(long), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+    for (e = 0; e < (int)(sizeof(engines)/sizeof(engines[0])); e++) {
+        engine_name = engines[e].name;
+        if (stm_set_fault_engine(engines[e].engine) != 0) {
+            printf("%s: not available here, skipped\n", engine_name);
+            continue;
+        }
+        for (i = 0; i < (int)(sizeof(tests)/sizeof(tests[0])); i++) {
+            for (j = 1; j < argc && strcmp(argv[j], tests[i].name) != 0; j++)
+                ;
+            if (argc == 1 || j < argc)
+                tests[i].fn();
+        }
+    }
+
+    stm_close();
+    exit(failures);
+}
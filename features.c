@@ -0,0 +1,681 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h> // for getpid(), fork()
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stm.h"
+
+// Tests of features of stm.c that example.c doesn't exercise.  Each test runs in processes of its own, on a
+// segment of its own, and checks what they have left in it.  Run stmtest3 with no arguments, or with the names
+// of the tests to run.  The tests are run with each fault engine there is, and print a line for each check.
+// stmtest3 exits with the number that failed.
+
+
+#define n_pages 64
+#define SEGSIZE (n_pages * 4096)
+#define page_word(b, p) ((b)[(p) * 512])     // the first long of page p
+
+extern int32_t doomed_transactions, eager_locks, nested_retries;   // stm.c's counts, as print_collision_histo()
+                                                                    // shows them
+
+static int failures;
+static char *engine_name;                   // the fault engine the tests are running with
+
+static void check(char *test, char *what, int ok) {
+    printf("%s: %s: %s: %s\n", engine_name, test, what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+// Start a test with a new segment, with nothing left from earlier runs.
+//
+static void new_segment_file(char *filename) {
+    char metadata_filename[256];
+
+    snprintf(metadata_filename, sizeof(metadata_filename), "%s.metadata", filename);
+    unlink(filename);
+    unlink(metadata_filename);
+}
+
+static struct shared_segment *open_segment(char *filename) {
+    struct shared_segment *seg;
+
+    if ((seg = stm_open_shared_segment(filename, SEGSIZE, NULL, PROT_NONE)) == NULL) {
+        fprintf(stderr, "can't open %s: stm_errno %d\n", filename, stm_errno());
+        exit(-1);
+    }
+    return seg;
+}
+
+// A word outside the segments, shared by the processes of a test, so that they can take turns.  It is 0 as each
+// test's processes start.
+//
+static volatile long *turns;
+
+static void wait_for_turn(long turn) {
+    while (*turns != turn)
+        sched_yield();
+}
+
+// Run fn(seg, i, n) in each of n new processes, and return how many of them failed.
+//
+static int run_processes(int n, char *filename, int (*fn)(struct shared_segment *seg, int i, int n)) {
+    int i, status, failed = 0;
+    pid_t pid;
+
+    *turns = 0;
+    fflush(stdout);
+    for (i = 0; i < n; i++) {
+        if ((pid = fork()) == 0)
+            _exit(fn(open_segment(filename), i, n));
+        if (pid < 0) {
+            perror("fork");
+            exit(-1);
+        }
+    }
+
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    return failed;
+}
+
+// The sum of the first words of pages 1 and up, which the tests keep equal to page 0's.
+//
+static long sum_pages(volatile long *b) {
+    long sum = 0;
+    int p;
+
+    for (p = 1; p < n_pages; p++)
+        sum += page_word(b, p);
+    return sum;
+}
+
+// What the processes left:  page 0's word, and the sum of the others.
+//
+static void count_pages(char *filename, long *count, long *sum) {
+    struct shared_segment *seg = open_segment(filename);
+    volatile long *b = stm_segment_base(seg);
+
+    stm_start_transaction("count");
+    *count = page_word(b, 0);
+    *sum = sum_pages(b);
+    stm_commit_transaction("count");
+    stm_close_shared_segment(seg);
+}
+
+
+//
+// Irrevocable transactions.  Some of the transactions become irrevocable half way through, while the others
+// commit around them, and each irrevocable one counts how many times it got past stm_become_irrevocable(),
+// which should be once.
+//
+
+#define irrevocable_iterations 300
+
+static int irrevocable_escalation(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int escalations = 0, irrevocable = 0;
+    volatile int j;
+    int p;
+
+    (void)n;    // always 4
+    srandom(getpid());
+    for (j = 0; j < irrevocable_iterations; j++) {
+        p = 1 + random() % (n_pages - 1);
+        stm_start_transaction("escalate");
+        page_word(b, 0) += 1;
+        if (j % 10 == i) {
+            if (stm_become_irrevocable() != 0)
+                return 1;
+            escalations++;
+        }
+        page_word(b, p) += 1;
+        stm_commit_transaction("escalate");
+        if (j % 10 == i)
+            irrevocable++;
+    }
+    return escalations != irrevocable;
+}
+
+// A process that dies holding the token mustn't keep everybody else out.
+//
+static int irrevocable_holder_dies(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+
+    (void)i;    // there is only one
+    (void)n;
+    stm_start_transaction("die");
+    stm_become_irrevocable();
+    page_word(b, 1) = 1;
+    _exit(0);
+}
+
+static void test_irrevocable() {
+    char *filename = "/tmp/stmtest3-irrevocable";
+    long count, sum;
+
+    new_segment_file(filename);
+    check("irrevocable", "no irrevocable transaction retried", run_processes(4, filename, irrevocable_escalation) == 0);
+    run_processes(1, filename, irrevocable_holder_dies);
+
+    count_pages(filename, &count, &sum);        // which can't start until the token is taken back
+    check("irrevocable", "every transaction counted once", count == 4 * irrevocable_iterations && sum == count);
+    check("irrevocable", "token taken back from a dead holder", 1);
+}
+
+
+//
+// The version clock.  Transactions count in page 0 and a random other page, and every tenth one only reads,
+// and checks that what it saw adds up, as it must for any transaction that commits.  On a segment created to use
+// the version clock, so that pages are checked against the time they last changed.
+//
+
+#define counting_iterations 300
+
+static int counting(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int j, k, consistent;
+    int p;
+
+    (void)i;    // all the processes do the same
+    (void)n;
+    srandom(getpid());
+    for (j = 0; j < counting_iterations; j++) {
+        if (j % 10 == 0) {
+            stm_start_transaction("look");
+            consistent = page_word(b, 0) == sum_pages(b);
+            stm_commit_transaction("look");
+            if (!consistent)
+                return 1;
+        }
+        p = 1 + random() % (n_pages - 1);
+        stm_start_transaction("count");
+        page_word(b, 0) += 1;
+        for (k = 0; k < 1000; k++)
+            ;
+        page_word(b, p) += 1;
+        stm_commit_transaction("count");
+    }
+    return 0;
+}
+
+// Write skew.  In each round, process 0 sets its flag in page 1 if process 1's in the last page isn't set, and
+// process 1 the other way around, writing all the pages in between too, so that it takes a while to lock them.
+// Each only reads the page the other writes, so the two transactions only conflict if the pages they read are
+// checked after the pages they write are locked.  At most one flag of a round may be set.  The rounds start
+// together, and process 0 waits a random while before committing, so that the commits sometimes overlap.
+//
+
+#define skew_rounds 500
+
+static int write_skew(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile long *first = b + 512, *last = b + 512 * (n_pages - 1);
+    volatile int r, p, k, delay;
+
+    srandom(getpid());
+    for (r = 0; r < skew_rounds; r++) {
+        __sync_fetch_and_add(turns, 1);
+        while (*turns < n * (r + 1))
+            sched_yield();
+        delay = random() % 20000;
+        stm_start_transaction("skew");
+        if (i == 0 && last[r] == 0) {
+            first[r] = 1;
+            for (k = 0; k < delay; k++)
+                ;
+        }
+        if (i == 1 && first[r] == 0) {
+            for (p = 2; p < n_pages; p++)
+                b[512 * p + r] = 1;
+        }
+        stm_commit_transaction("skew");
+    }
+    return 0;
+}
+
+static void test_version_clock() {
+    char *filename = "/tmp/stmtest3-version-clock";
+    struct shared_segment *seg;
+    volatile long *b;
+    long count, sum;
+    volatile int skewed = 0;
+    int r;
+
+    new_segment_file(filename);
+    stm_set_validation(STM_VALIDATE_VERSION_CLOCK);
+    check("version_clock", "every transaction saw a consistent segment", run_processes(4, filename, counting) == 0);
+    count_pages(filename, &count, &sum);
+    check("version_clock", "every transaction counted once", count == 4 * counting_iterations && sum == count);
+
+    new_segment_file(filename);
+    run_processes(2, filename, write_skew);
+    seg = open_segment(filename);
+    b = stm_segment_base(seg);
+    stm_start_transaction("skewed");
+    for (r = 0; r < skew_rounds; r++)
+        skewed += b[512 + r] && b[512 * (n_pages - 1) + r];
+    stm_commit_transaction("skewed");
+    stm_close_shared_segment(seg);
+    check("version_clock", "no write skew", skewed == 0);
+    stm_set_validation(STM_VALIDATE_TRANSACTION_IDS);
+}
+
+
+//
+// Eager locking.  The same counting, with pages locked at their first write as soon as they have been fought over
+// at all.  Each process adds the number of pages it locked early to the second word of page 0.
+//
+
+static int counting_eagerly(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    int failed = counting(seg, i, n);
+
+    stm_start_transaction("eager");
+    b[1] += eager_locks;
+    stm_commit_transaction("eager");
+    return failed;
+}
+
+static void test_eager() {
+    char *filename = "/tmp/stmtest3-eager";
+    struct shared_segment *seg;
+    long count, sum, locked;
+
+    new_segment_file(filename);
+    stm_set_eager_threshold(1);
+    check("eager", "every transaction saw a consistent segment", run_processes(4, filename, counting_eagerly) == 0);
+    stm_set_eager_threshold(8);
+
+    count_pages(filename, &count, &sum);
+    check("eager", "every transaction counted once", count == 4 * counting_iterations && sum == count);
+    seg = open_segment(filename);
+    stm_start_transaction("locked");
+    locked = ((volatile long *)stm_segment_base(seg))[1];
+    stm_commit_transaction("locked");
+    stm_close_shared_segment(seg);
+    check("eager", "pages locked early", locked > 0);
+}
+
+
+//
+// stm_retry().  One process puts the numbers 1 to retry_items through a one-word slot, and another takes them
+// out, each waiting in stm_retry() for the other when the slot isn't the way it needs it.  Then a transaction
+// waits for the empty slot with a timeout, and is given up on.
+//
+
+#define retry_items 200
+#define retry_timeout 50000000      // nanoseconds
+
+static int producer_consumer(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile long k;
+
+    (void)n;    // always 2
+    for (k = 1; k <= retry_items; k++) {
+        if (i == 0) {
+            stm_start_transaction("produce");
+            if (page_word(b, 1) != 0)
+                stm_retry();
+            page_word(b, 1) = k;
+            stm_commit_transaction("produce");
+        } else {
+            stm_start_transaction("consume");
+            if (page_word(b, 1) == 0)
+                stm_retry();
+            page_word(b, 2) += page_word(b, 1);
+            page_word(b, 1) = 0;
+            stm_commit_transaction("consume");
+        }
+    }
+    return 0;
+}
+
+static int retry_gives_up(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    struct timespec start, end;
+    long elapsed;
+    int status;
+
+    (void)i;    // there is only one
+    (void)n;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stm_start_transaction_limited("wait", 0, retry_timeout, status);
+    if (status == 0) {
+        if (page_word(b, 1) == 0)
+            stm_retry();
+        stm_commit_transaction("wait");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+    return !(status == 1 && stm_errno() == STM_RETRY_LIMIT_ERROR && elapsed >= retry_timeout &&
+             elapsed < 20 * retry_timeout);
+}
+
+static void test_retry() {
+    char *filename = "/tmp/stmtest3-retry";
+    struct shared_segment *seg;
+    long total;
+
+    new_segment_file(filename);
+    check("retry", "producer and consumer finished", run_processes(2, filename, producer_consumer) == 0);
+    seg = open_segment(filename);
+    stm_start_transaction("total");
+    total = page_word((volatile long *)stm_segment_base(seg), 2);
+    stm_commit_transaction("total");
+    stm_close_shared_segment(seg);
+    check("retry", "every item taken once", total == retry_items * (retry_items + 1) / 2);
+    check("retry", "limited wait given up at the timeout", run_processes(1, filename, retry_gives_up) == 0);
+}
+
+
+//
+// Closed nesting.  Each transaction counts in a page of its own process, and then, in a nested transaction, in
+// page 0, which everyone fights over, and in another page of its own.  A conflict over page 0 should mostly be
+// retried in the nested transaction alone.  Each process adds the number of those to the second word of page 0.
+//
+
+#define nesting_iterations 300
+
+static int nesting(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int j, k;
+
+    for (j = 0; j < nesting_iterations; j++) {
+        stm_start_transaction("outer");
+        page_word(b, 1 + i) += 1;
+        stm_start_transaction("inner");
+        page_word(b, 0) += 1;
+        for (k = 0; k < 1000; k++)
+            ;
+        page_word(b, 1 + n + i) += 1;
+        stm_commit_transaction("inner");
+        stm_commit_transaction("outer");
+    }
+
+    stm_start_transaction("nested");
+    b[1] += nested_retries;
+    stm_commit_transaction("nested");
+    return 0;
+}
+
+static void test_nesting() {
+    char *filename = "/tmp/stmtest3-nesting";
+    struct shared_segment *seg;
+    long count, sum, retried;
+
+    new_segment_file(filename);
+    stm_set_validation(STM_VALIDATE_VERSION_CLOCK);
+    stm_set_closed_nesting(1);
+    run_processes(4, filename, nesting);
+    stm_set_validation(STM_VALIDATE_TRANSACTION_IDS);
+
+    count_pages(filename, &count, &sum);
+    check("nesting", "every transaction counted once", count == 4 * nesting_iterations && sum == 2 * count);
+    seg = open_segment(filename);
+    stm_start_transaction("retried");
+    retried = ((volatile long *)stm_segment_base(seg))[1];
+    stm_commit_transaction("retried");
+    stm_close_shared_segment(seg);
+    check("nesting", "nested transactions retried by themselves", retried > 0);
+}
+
+
+//
+// Merge mode.  Process 0 adds to a word in page 1, and before committing, waits for process 1 to commit an add to
+// another word of the same page.  If the two words are in different cache lines, the changes are merged and
+// process 0 commits the first time.  If they are in the same line, process 0 has to try again, and then sees
+// what process 1 did.
+//
+
+static int merge_offset;                    // the word process 1 adds to, counting from process 0's
+static int merge_attempts;                  // how many times process 0 should start its transaction
+
+static int merging(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int attempts = 0;
+
+    (void)n;    // always 2
+    stm_set_merge_mode(seg, 1);
+    if (i == 0) {
+        stm_start_transaction("first");
+        b[512] += 1;
+        if (attempts++ == 0) {
+            *turns = 1;
+            wait_for_turn(2);
+        }
+        stm_commit_transaction("first");
+        return attempts != merge_attempts;
+    }
+
+    wait_for_turn(1);
+    stm_start_transaction("second");
+    b[512 + merge_offset] += 2;
+    stm_commit_transaction("second");
+    *turns = 2;
+    return 0;
+}
+
+// Returns 1 if both processes' adds are in the segment.
+//
+static int both_added(char *filename) {
+    struct shared_segment *seg = open_segment(filename);
+    volatile long *b = stm_segment_base(seg);
+    int added;
+
+    stm_start_transaction("added");
+    added = b[512] == 1 && b[512 + merge_offset] == 2;
+    stm_commit_transaction("added");
+    stm_close_shared_segment(seg);
+    return added;
+}
+
+static void test_merge() {
+    char *filename = "/tmp/stmtest3-merge";
+
+    new_segment_file(filename);
+    merge_offset = 64;
+    merge_attempts = 1;
+    check("merge", "writes to different lines of a page both committed", run_processes(2, filename, merging) == 0);
+    check("merge", "both writes kept", both_added(filename));
+
+    new_segment_file(filename);
+    merge_offset = 1;
+    merge_attempts = 2;
+    check("merge", "writes to the same line conflicted", run_processes(2, filename, merging) == 0);
+    check("merge", "the retried write kept the other", both_added(filename));
+}
+
+
+//
+// Visible readers.  Process 0 reads page 1, and before going on, waits for process 1 to commit a change to it,
+// which should doom process 0's transaction, so that it is aborted at its next fault rather than at its commit.
+//
+
+static int dooming(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int attempts = 0, faulted = 0;
+    volatile long seen;
+
+    (void)n;    // always 2
+    if (i == 0) {
+        stm_start_transaction("doomed");
+        seen = page_word(b, 1);
+        if (attempts++ == 0) {
+            *turns = 1;
+            wait_for_turn(2);
+        }
+        seen += page_word(b, 2);
+        faulted++;
+        stm_commit_transaction("doomed");
+        return !(attempts == 2 && faulted == 1 && seen == 1);
+    }
+
+    wait_for_turn(1);
+    stm_start_transaction("doom");
+    page_word(b, 1) = 1;
+    stm_commit_transaction("doom");
+    *turns = 2;
+    return doomed_transactions != 1;
+}
+
+static void test_doomed() {
+    char *filename = "/tmp/stmtest3-doomed";
+
+    new_segment_file(filename);
+    stm_set_visible_readers(1);
+    check("doomed", "reader doomed by a commit, and aborted at its next fault",
+          run_processes(2, filename, dooming) == 0);
+    stm_set_visible_readers(0);
+}
+
+
+//
+// Contention managers.  Process 0's transaction reads page 1 and writes page 2, and the first time, before
+// committing, waits for process 1 to commit a change to page 1, so that it is aborted once.  Its contention
+// manager should be called once, with what is known about that attempt.
+//
+
+static stm_contention managed;              // what process 0's contention manager was last given,
+static int managed_calls;                   // and how many times it was called
+
+static long recording_manager(stm_contention *c) {
+    managed = *c;
+    managed_calls++;
+    return 0;
+}
+
+static int contending(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int attempts = 0;
+
+    (void)n;    // always 2
+    if (i == 0) {
+        stm_set_contention_manager("managed", recording_manager);
+        stm_start_transaction("managed");
+        page_word(b, 2) = page_word(b, 1);
+        if (attempts++ == 0) {
+            *turns = 1;
+            wait_for_turn(2);
+        }
+        stm_commit_transaction("managed");
+        return !(attempts == 2 && managed_calls == 1 && strcmp(managed.trans_name, "managed") == 0 &&
+                 managed.reason == STM_COLLISION_ERROR && managed.retries == 1 && managed.age > 0 &&
+                 managed.karma == 2);
+    }
+
+    wait_for_turn(1);
+    stm_start_transaction("change");
+    page_word(b, 1) = 1;
+    stm_commit_transaction("change");
+    *turns = 2;
+    return 0;
+}
+
+static void test_contention() {
+    char *filename = "/tmp/stmtest3-contention";
+
+    new_segment_file(filename);
+    check("contention", "contention manager called with the aborted attempt",
+          run_processes(2, filename, contending) == 0);
+}
+
+
+//
+// Bounded retries.  As above, but process 1 changes the page every time, so process 0's transaction, started with
+// stm_start_transaction_limited(), is aborted until it is given up on after its last attempt.
+//
+
+#define limited_attempts 3
+
+static int limited(struct shared_segment *seg, int i, int n) {
+    volatile long *b = stm_segment_base(seg);
+    volatile int attempts = 0, k;
+    int status;
+
+    (void)n;    // always 2
+    if (i == 0) {
+        stm_start_transaction_limited("limited", limited_attempts, 0, status);
+        if (status == 0) {
+            attempts++;
+            page_word(b, 2) = page_word(b, 1);
+            *turns = 2 * attempts - 1;
+            wait_for_turn(2 * attempts);
+            stm_commit_transaction("limited");
+            return 1;
+        }
+        return !(status == 1 && attempts == limited_attempts && stm_errno() == STM_RETRY_LIMIT_ERROR &&
+                 stm_abort_reason() == STM_COLLISION_ERROR);
+    }
+
+    for (k = 1; k <= limited_attempts; k++) {
+        wait_for_turn(2 * k - 1);
+        stm_start_transaction("change");
+        page_word(b, 1) += 1;
+        stm_commit_transaction("change");
+        *turns = 2 * k;
+    }
+    return 0;
+}
+
+static void test_limited() {
+    char *filename = "/tmp/stmtest3-limited";
+
+    new_segment_file(filename);
+    check("limited", "given up on after the last attempt allowed", run_processes(2, filename, limited) == 0);
+}
+
+
+struct {
+    char *name;
+    void (*fn)();
+} tests[] = {
+    { "irrevocable",    test_irrevocable },
+    { "version_clock",  test_version_clock },
+    { "eager",          test_eager },
+    { "retry",          test_retry },
+    { "nesting",        test_nesting },
+    { "merge",          test_merge },
+    { "doomed",         test_doomed },
+    { "contention",     test_contention },
+    { "limited",        test_limited },
+};
+
+struct {
+    char *name;
+    int engine;
+} engines[] = {
+    { "signal",         STM_ENGINE_SIGNAL },
+    { "userfaultfd",    STM_ENGINE_USERFAULTFD },
+};
+
+int main(int argc, const char * argv[]) {
+    int e, i, j;
+
+    stm_init(0x1);
+    turns = mmap(0, sizeof(long), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+    for (e = 0; e < (int)(sizeof(engines)/sizeof(engines[0])); e++) {
+        engine_name = engines[e].name;
+        if (stm_set_fault_engine(engines[e].engine) != 0) {
+            printf("%s: not available here, skipped\n", engine_name);
+            continue;
+        }
+        for (i = 0; i < (int)(sizeof(tests)/sizeof(tests[0])); i++) {
+            for (j = 1; j < argc && strcmp(argv[j], tests[i].name) != 0; j++)
+                ;
+            if (argc == 1 || j < argc)
+                tests[i].fn();
+        }
+    }
+
+    stm_close();
+    exit(failures);
+}
@@ -0,0 +1,146 @@
+/*
+
+ pagebench.c
+
+ Micro-benchmark of the page compare and copy operations in pageops.c, in each implementation this CPU supports,
+ against libc's memcmp() and memcpy(), on 4 KB and 2 MB pages.   Not part of the core package.
+
+ Usage:  pagebench [megabytes per test]
+
+ Copyright 2009 Shel Kaphan
+
+ This file is part of stmmap.
+
+ stmmap is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ stmmap is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with stmmap.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "pageops.h"
+
+
+static const char *impls[] = { "generic", "sse2", "avx2", "avx512" };
+
+static volatile int sink;       // keeps results from being optimized away
+
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *impl, const char *op, size_t size, long reps, double elapsed) {
+    printf("%-8s %-16s %8lu  %10.1f ns/page  %7.2f GB/s\n", impl, op, (unsigned long)size,
+           elapsed * 1e9 / reps, (double)size * reps / elapsed / 1e9);
+}
+
+// a, b, c and d are each n_pages pages of the given size; a and b are the same, and d is different.  The tests
+// cycle through the pages so that the larger working sets are not all in the cache.
+//
+static void bench(size_t size, int n_pages, long reps, char *a, char *b, char *c, char *d) {
+    static const char *diff_tests[] = { "diff+copy all", "diff+copy all nt", "diff+copy none" };
+    uint64_t mask[PAGEOPS_MASK_WORDS(2*1024*1024)];
+    double t;
+    long i;
+    int j, k, test;
+    char *pa, *pb, *pc;
+
+    for (k = -1; k < (int)(sizeof(impls)/sizeof(impls[0])); k++) {
+        const char *name = (k < 0) ? "libc" : impls[k];
+
+        if (k >= 0 && pageops_select(name) != 0)
+            continue;
+
+        // comparing equal pages has to look at every byte.
+        t = now();
+        for (i = 0; i < reps; i++) {
+            j = i % n_pages;
+            pa = a + j * size;
+            pb = b + j * size;
+            sink += (k < 0) ? (memcmp(pa, pb, size) != 0) : page_differs(pa, pb, size);
+        }
+        report(name, "compare", size, reps, now() - t);
+
+        // page_copy() is memcpy() in every implementation, so copying is only measured once.
+        if (k < 0) {
+            t = now();
+            for (i = 0; i < reps; i++) {
+                j = i % n_pages;
+                pa = a + j * size;
+                pc = c + j * size;
+                memcpy(pc, pa, size);
+            }
+            report(name, "copy", size, reps, now() - t);
+        }
+
+        // writing back a page that has changed throughout, with and without non-temporal stores, and one that
+        // has not changed at all.  libc has to compare and copy the whole page either way.
+        for (test = 0; test < 3; test++) {
+            if (k < 0 && test > 0)
+                break;
+            t = now();
+            for (i = 0; i < reps; i++) {
+                j = i % n_pages;
+                pa = a + j * size;
+                pb = ((test == 2) ? b : d) + j * size;
+                pc = c + j * size;
+                if (k < 0) {
+                    memcpy(pc, pa, size);
+                    sink += (memcmp(pa, pb, size) != 0);
+                } else {
+                    sink += page_diff_copy(pc, pa, pb, size, mask, test == 1);
+                }
+            }
+            report(name, (k < 0) ? "compare+copy" : diff_tests[test], size, reps, now() - t);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = (argc > 1) ? atoi(argv[1]) : 1024;
+    size_t sizes[] = { 4096, 2*1024*1024 };
+    size_t working_set = 32*1024*1024;  // per buffer, bigger than the caches
+    char *a, *b, *c, *d;
+    size_t i;
+
+    if (posix_memalign((void**)&a, 4096, working_set) || posix_memalign((void**)&b, 4096, working_set) ||
+        posix_memalign((void**)&c, 4096, working_set) || posix_memalign((void**)&d, 4096, working_set)) {
+        fprintf(stderr, "pagebench: out of memory\n");
+        return 1;
+    }
+    memset(a, 1, working_set);
+    memset(b, 1, working_set);
+    memset(c, 0, working_set);
+    memset(d, 2, working_set);
+
+    pageops_init();
+    printf("best implementation on this CPU: %s\n\n", pageops_name());
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        // a hot working set of a few pages, as in a small transaction, and one bigger than the caches.
+        bench(sizes[i], (sizes[i] < 65536) ? 4 : 1, megabytes * 1024 * 1024 / sizes[i], a, b, c, d);
+        printf("\n");
+        bench(sizes[i], working_set / sizes[i], megabytes * 1024 * 1024 / sizes[i], a, b, c, d);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+
+ pageops.c
+
+ Page-sized compare and copy operations.  The compares have versions using SSE2, AVX2 and AVX-512 on x86
+ processors, picked at run time according to what the CPU supports; elsewhere, libc's memcmp() is used.  Plain
+ copies always use libc's memcpy(), which is faster than anything here.
+
+ Copyright 2009 Shel Kaphan
+
+ This file is part of stmmap.
+
+ stmmap is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ stmmap is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with stmmap.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <string.h>
+
+#include "pageops.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PAGEOPS_X86
+#include <immintrin.h>
+#endif
+
+
+
+static int generic_differs(const void *a, const void *b, size_t size) {
+    return memcmp(a, b, size) != 0;
+}
+
+static int generic_diff_copy(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                             int nontemporal) {
+    size_t offset;
+    int n_changed = 0;
+
+    (void)nontemporal;      // plain C has no way to ask for it
+
+    memset(line_mask, 0, PAGEOPS_MASK_WORDS(size) * sizeof(uint64_t));
+    for (offset = 0; offset < size; offset += PAGEOPS_LINE) {
+        if (memcmp(src + offset, ref + offset, PAGEOPS_LINE) != 0) {
+            memcpy(dst + offset, src + offset, PAGEOPS_LINE);
+            line_mask[offset/PAGEOPS_LINE/64] |= (uint64_t)1 << (offset/PAGEOPS_LINE%64);
+            n_changed++;
+        }
+    }
+    return n_changed;
+}
+
+
+#ifdef PAGEOPS_X86
+
+// The compare loops handle 256 bytes, four cache lines, per iteration, and the compares stop at the first
+// difference.  The diff-and-copy loops go a cache line at a time, and only store the lines that differ.  They are
+// compiled twice, for each kind of store, so there is no test for it inside the loop.
+
+__attribute__((target("sse2")))
+static int sse2_differs(const void *a, const void *b, size_t size) {
+    const __m128i *pa = a, *pb = b;
+    __m128i x, y;
+    size_t i, j;
+
+    for (i = 0; i < size/sizeof(__m128i); i += 16) {
+        x = _mm_xor_si128(_mm_load_si128(pa+i), _mm_load_si128(pb+i));
+        for (j = 1; j < 16; j += 3) {
+            y = _mm_or_si128(_mm_xor_si128(_mm_load_si128(pa+i+j), _mm_load_si128(pb+i+j)),
+                             _mm_xor_si128(_mm_load_si128(pa+i+j+1), _mm_load_si128(pb+i+j+1)));
+            x = _mm_or_si128(x, _mm_or_si128(y, _mm_xor_si128(_mm_load_si128(pa+i+j+2), _mm_load_si128(pb+i+j+2))));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff)
+            return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline int sse2_diff_copy_loop(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                                      const int nontemporal) {
+    const __m128i *s = src, *r = ref;
+    __m128i *d = dst;
+    __m128i v0, v1, v2, v3, x;
+    size_t line, i;
+    uint64_t bits = 0;
+    int n_changed = 0;
+
+    for (line = 0, i = 0; line < size/PAGEOPS_LINE; line++, i += 4) {
+        v0 = _mm_load_si128(s+i);
+        v1 = _mm_load_si128(s+i+1);
+        v2 = _mm_load_si128(s+i+2);
+        v3 = _mm_load_si128(s+i+3);
+        x = _mm_or_si128(_mm_or_si128(_mm_xor_si128(v0, _mm_load_si128(r+i)), _mm_xor_si128(v1, _mm_load_si128(r+i+1))),
+                         _mm_or_si128(_mm_xor_si128(v2, _mm_load_si128(r+i+2)), _mm_xor_si128(v3, _mm_load_si128(r+i+3))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff) {
+            if (nontemporal) {
+                _mm_stream_si128(d+i, v0);
+                _mm_stream_si128(d+i+1, v1);
+                _mm_stream_si128(d+i+2, v2);
+                _mm_stream_si128(d+i+3, v3);
+            } else {
+                _mm_store_si128(d+i, v0);
+                _mm_store_si128(d+i+1, v1);
+                _mm_store_si128(d+i+2, v2);
+                _mm_store_si128(d+i+3, v3);
+            }
+            bits |= (uint64_t)1 << (line%64);
+            n_changed++;
+        }
+        if (line%64 == 63 || line == size/PAGEOPS_LINE - 1) {
+            line_mask[line/64] = bits;
+            bits = 0;
+        }
+    }
+    if (nontemporal)
+        _mm_sfence();
+    return n_changed;
+}
+
+__attribute__((target("sse2")))
+static int sse2_diff_copy(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                          int nontemporal) {
+    return nontemporal ? sse2_diff_copy_loop(dst, src, ref, size, line_mask, 1)
+                       : sse2_diff_copy_loop(dst, src, ref, size, line_mask, 0);
+}
+
+
+__attribute__((target("avx2")))
+static int avx2_differs(const void *a, const void *b, size_t size) {
+    const __m256i *pa = a, *pb = b;
+    __m256i x;
+    size_t i;
+
+    for (i = 0; i < size/sizeof(__m256i); i += 8) {
+        x = _mm256_or_si256(_mm256_or_si256(_mm256_xor_si256(_mm256_load_si256(pa+i), _mm256_load_si256(pb+i)),
+                                            _mm256_xor_si256(_mm256_load_si256(pa+i+1), _mm256_load_si256(pb+i+1))),
+                            _mm256_or_si256(_mm256_xor_si256(_mm256_load_si256(pa+i+2), _mm256_load_si256(pb+i+2)),
+                                            _mm256_xor_si256(_mm256_load_si256(pa+i+3), _mm256_load_si256(pb+i+3))));
+        x = _mm256_or_si256(x,
+                _mm256_or_si256(_mm256_or_si256(_mm256_xor_si256(_mm256_load_si256(pa+i+4), _mm256_load_si256(pb+i+4)),
+                                                _mm256_xor_si256(_mm256_load_si256(pa+i+5), _mm256_load_si256(pb+i+5))),
+                                _mm256_or_si256(_mm256_xor_si256(_mm256_load_si256(pa+i+6), _mm256_load_si256(pb+i+6)),
+                                                _mm256_xor_si256(_mm256_load_si256(pa+i+7), _mm256_load_si256(pb+i+7)))));
+        if (!_mm256_testz_si256(x, x))
+            return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline int avx2_diff_copy_loop(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                                      const int nontemporal) {
+    const __m256i *s = src, *r = ref;
+    __m256i *d = dst;
+    __m256i v0, v1, x;
+    size_t line, i;
+    uint64_t bits = 0;
+    int n_changed = 0;
+
+    for (line = 0, i = 0; line < size/PAGEOPS_LINE; line++, i += 2) {
+        v0 = _mm256_load_si256(s+i);
+        v1 = _mm256_load_si256(s+i+1);
+        x = _mm256_or_si256(_mm256_xor_si256(v0, _mm256_load_si256(r+i)),
+                            _mm256_xor_si256(v1, _mm256_load_si256(r+i+1)));
+        if (!_mm256_testz_si256(x, x)) {
+            if (nontemporal) {
+                _mm256_stream_si256(d+i, v0);
+                _mm256_stream_si256(d+i+1, v1);
+            } else {
+                _mm256_store_si256(d+i, v0);
+                _mm256_store_si256(d+i+1, v1);
+            }
+            bits |= (uint64_t)1 << (line%64);
+            n_changed++;
+        }
+        if (line%64 == 63 || line == size/PAGEOPS_LINE - 1) {
+            line_mask[line/64] = bits;
+            bits = 0;
+        }
+    }
+    if (nontemporal)
+        _mm_sfence();
+    return n_changed;
+}
+
+__attribute__((target("avx2")))
+static int avx2_diff_copy(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                          int nontemporal) {
+    return nontemporal ? avx2_diff_copy_loop(dst, src, ref, size, line_mask, 1)
+                       : avx2_diff_copy_loop(dst, src, ref, size, line_mask, 0);
+}
+
+
+__attribute__((target("avx512f")))
+static int avx512_differs(const void *a, const void *b, size_t size) {
+    const __m512i *pa = a, *pb = b;
+    __m512i x;
+    size_t i;
+
+    for (i = 0; i < size/sizeof(__m512i); i += 4) {
+        x = _mm512_or_si512(_mm512_or_si512(_mm512_xor_si512(_mm512_load_si512(pa+i), _mm512_load_si512(pb+i)),
+                                            _mm512_xor_si512(_mm512_load_si512(pa+i+1), _mm512_load_si512(pb+i+1))),
+                            _mm512_or_si512(_mm512_xor_si512(_mm512_load_si512(pa+i+2), _mm512_load_si512(pb+i+2)),
+                                            _mm512_xor_si512(_mm512_load_si512(pa+i+3), _mm512_load_si512(pb+i+3))));
+        if (_mm512_test_epi64_mask(x, x))
+            return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline int avx512_diff_copy_loop(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                                        const int nontemporal) {
+    const __m512i *s = src, *r = ref;
+    __m512i *d = dst;
+    __m512i v;
+    size_t line;
+    uint64_t bits = 0;
+    int n_changed = 0;
+
+    for (line = 0; line < size/PAGEOPS_LINE; line++) {
+        v = _mm512_load_si512(s+line);
+        if (_mm512_cmpneq_epi64_mask(v, _mm512_load_si512(r+line))) {
+            if (nontemporal)
+                _mm512_stream_si512(d+line, v);
+            else
+                _mm512_store_si512(d+line, v);
+            bits |= (uint64_t)1 << (line%64);
+            n_changed++;
+        }
+        if (line%64 == 63 || line == size/PAGEOPS_LINE - 1) {
+            line_mask[line/64] = bits;
+            bits = 0;
+        }
+    }
+    if (nontemporal)
+        _mm_sfence();
+    return n_changed;
+}
+
+__attribute__((target("avx512f")))
+static int avx512_diff_copy(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask,
+                            int nontemporal) {
+    return nontemporal ? avx512_diff_copy_loop(dst, src, ref, size, line_mask, 1)
+                       : avx512_diff_copy_loop(dst, src, ref, size, line_mask, 0);
+}
+
+#endif // PAGEOPS_X86
+
+
+
+typedef struct pageops_impl {
+    const char *name;
+    int (*differs)(const void *, const void *, size_t);
+    int (*diff_copy)(void *, const void *, const void *, size_t, uint64_t *, int);
+} pageops_impl;
+
+static const pageops_impl pageops_impls[] = {
+    { "generic", generic_differs, generic_diff_copy },
+#ifdef PAGEOPS_X86
+    { "sse2", sse2_differs, sse2_diff_copy },
+    { "avx2", avx2_differs, avx2_diff_copy },
+    { "avx512", avx512_differs, avx512_diff_copy },
+#endif
+};
+
+#define n_pageops_impls (sizeof(pageops_impls)/sizeof(pageops_impls[0]))
+
+static const pageops_impl *pageops = &pageops_impls[0];
+
+
+static int pageops_supported(const pageops_impl *impl) {
+#ifdef PAGEOPS_X86
+    __builtin_cpu_init();
+    if (strcmp(impl->name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+    if (strcmp(impl->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(impl->name, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f");
+#endif
+    return strcmp(impl->name, "generic") == 0;
+}
+
+void pageops_init() {
+    int i;
+
+    // The implementations are listed from least to most capable.
+    for (i = n_pageops_impls - 1; i > 0; i--) {
+        if (pageops_supported(&pageops_impls[i]))
+            break;
+    }
+    pageops = &pageops_impls[i];
+}
+
+int pageops_select(const char *name) {
+    int i;
+
+    for (i = 0; i < (int)n_pageops_impls; i++) {
+        if (strcmp(pageops_impls[i].name, name) == 0 && pageops_supported(&pageops_impls[i])) {
+            pageops = &pageops_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *pageops_name() {
+    return pageops->name;
+}
+
+
+int page_differs(const void *a, const void *b, size_t size) {
+    return pageops->differs(a, b, size);
+}
+
+// libc's memcpy() is faster at this than any of the kernels here, at least for pages that are in the cache.
+//
+void page_copy(void *dst, const void *src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+int page_diff_copy(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask, int nontemporal) {
+    return pageops->diff_copy(dst, src, ref, size, line_mask, nontemporal);
+}
+
+// This is only needed when two transactions have written the same page, so there is no need for it to be fast.
+//
+int page_changes_overlap(const void *a, const void *b, const void *ref, size_t size) {
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += PAGEOPS_LINE) {
+        if (memcmp(a + offset, ref + offset, PAGEOPS_LINE) != 0 && memcmp(b + offset, ref + offset, PAGEOPS_LINE) != 0)
+            return 1;
+    }
+    return 0;
+}
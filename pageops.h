@@ -0,0 +1,84 @@
+/*
+
+ pageops.h
+
+ This is the API for the page-sized compare and copy operations used by stm.c to take snapshots of pages and to
+ write modified pages back at commit.  The implementation is picked at run time according to what the CPU
+ supports.
+
+ Copyright 2009 Shel Kaphan
+
+ This file is part of stmmap.
+
+ stmmap is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ stmmap is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with stmmap.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// The granularity of page_diff_copy(), and the number of 64-bit words in its mask for a page of a given size.
+//
+#define PAGEOPS_LINE 64
+#define PAGEOPS_MASK_WORDS(size) (((size)/PAGEOPS_LINE + 63)/64)
+
+
+/*
+ All of these take buffers aligned to 64 bytes, and a size that is a multiple of 256 bytes, as pages are.
+ */
+
+/*
+ Returns nonzero if the size bytes at a and b differ.
+ */
+int page_differs(const void *a, const void *b, size_t size);
+
+/*
+ Copies size bytes from src to dst, leaving dst in the cache.  For taking snapshots.  This is just memcpy(),
+ which is faster than a SIMD loop of our own for pages in the cache.
+ */
+void page_copy(void *dst, const void *src, size_t size);
+
+/*
+ Copies to dst just the PAGEOPS_LINE byte lines of src that differ from ref, and returns how many there were.
+ Bit n of line_mask (PAGEOPS_MASK_WORDS(size) words, lowest bit of the first word first) is set if line n
+ was copied.  Reads src only once.  For writing modified pages back into the shared file.  If nontemporal
+ is set, dst bypasses the cache where possible, which is only faster when much more is being copied than fits
+ in the cache.
+ */
+int page_diff_copy(void *dst, const void *src, const void *ref, size_t size, uint64_t *line_mask, int nontemporal);
+
+/*
+ Returns nonzero if a and b have both changed some PAGEOPS_LINE byte line from what it is in ref.  For merging
+ the changes of two transactions to the same page.
+ */
+int page_changes_overlap(const void *a, const void *b, const void *ref, size_t size);
+
+
+/*
+ pageops_init() picks the best implementation for this CPU.  Until it is called, the baseline implementation
+ is used.  stm_init() calls it.
+ */
+void pageops_init();
+
+/*
+ pageops_select() picks a particular implementation:  "generic", "sse2", "avx2" or "avx512".
+ Returns 0, or -1 if it is not available on this CPU.  For testing and benchmarking.
+ */
+int pageops_select(const char *name);
+
+/*
+ Returns the name of the implementation in use.
+ */
+const char *pageops_name();
@@ -25,16 +25,33 @@
  */
 
 
+#ifdef __linux__
+#define _GNU_SOURCE         // for REG_ERR in <ucontext.h>
+#endif
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/errno.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>         // absolutely need this for pwrite().  (Just spent an hour chasing this...)
                             // (leaving it in even though I'm not using pwrite() right now...)
 #include <pthread.h>
+#include <sched.h>
+#include <ucontext.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#ifdef UFFDIO_WRITEPROTECT
+#define HAVE_USERFAULTFD
+#endif
+#endif
 
 #include "atomic-compat.h"
+#include "pageops.h"
 #include "stm.h"
 
 
@@ -51,30 +68,48 @@
  
  On all systems, MAP_PRIVATE implies that mapped pages we write to are private at
  least from the first write onward.
+
+ Pages that are only read during a transaction are never copied.  Whether they changed
+ underneath us is detected by the page's version in the metadata page table, at commit
+ time.  Writing a page takes a second fault, which is where the private copy is made.
  
  If PRIVATE_MAPPING_IS_PRIVATE is defined:
  
  - shared memory segments are mapped with MAP_SHARED
- - when transactions start the memory is protected with PROT_NONE (no access).
- - when pages are touched in transactions, they are mapped MAP_PRIVATE and
-    PROT_READ|PROT_WRITE (any access allowed).  
- - on commit the shared segment is mapped MAP_SHARED and the modified pages
-    are copied into it.
- - then the shared segment is protected with the user-specified protection between
-    transactions.
+ - between transactions, pages are PROT_NONE (no access) until first touched, and
+    then get the user-specified protection.  When transactions start, just the pages
+    touched since the last one are protected with PROT_NONE again.
+ - when pages are first touched in transactions, they are protected PROT_READ
+    but stay shared.  The version of the page is recorded but nothing is copied.
+ - when pages are written in transactions, they are mapped MAP_PRIVATE and
+    PROT_READ|PROT_WRITE (any access allowed), and a snapshot is taken.
+ - on commit the modified pages are copied into a second, always MAP_SHARED,
+    view of the file.
+ - then the modified pages are mapped MAP_SHARED again, and all the pages touched
+    by the transaction are protected with PROT_NONE.
  
  If PRIVATE_MAPPING_IS_PRIVATE is NOT defined:
  
  - "shared" memory segments are mapped with MAP_PRIVATE
- - when transactions start the memory is protected with PROT_NONE (no access).
- - when pages are touched in transactions, they are not remapped, but are
-    protected with PROT_READ|PROT_WRITE (any access allowed).  Because of
-    copy-on-write semantics with MAP_PRIVATE, we now have a private copy of the
-    written page that will not reflect changes made by other processes.
- - on commit the shared segment is mapped MAP_SHARED and the modified pages
-    are copied into it.
- - then the shared segment is mapped MAP_PRIVATE and protected with the
-    user-specified protection between transactions.
+ - between transactions, pages are PROT_NONE (no access) until first touched, and
+    then get the user-specified protection.  When transactions start, just the pages
+    touched since the last one are protected with PROT_NONE again.
+ - when pages are first touched in transactions, they are not remapped, but are
+    protected with PROT_READ.  Until the page is written, we see the file's
+    current contents.  The version of the page is recorded but nothing is copied.
+ - when pages are written in transactions, they are protected with
+    PROT_READ|PROT_WRITE (any access allowed).  Because of copy-on-write
+    semantics with MAP_PRIVATE, we now have a private copy of the written page
+    that will not reflect changes made by other processes.  A snapshot is taken.
+ - on commit the modified pages are copied into a second, MAP_SHARED, view of
+    the file.
+ - then the modified pages are mapped MAP_PRIVATE again, which discards our
+    private copies, and all the pages touched by the transaction are protected
+    with PROT_NONE.  Pages written between transactions are private copies too,
+    and are discarded the same way when the next transaction starts.
+ 
+ Segments opened with the userfaultfd fault engine (Linux only) do not depend on
+ either regime; see the comments at uffd_handler() below.
  
  */
 
@@ -90,10 +125,146 @@
 #define PAGE_ACCESS_SIGNAL SIGSEGV
 #endif
 
+// With the userfaultfd fault engine, this is the signal used to abort a transaction from the faulting thread.
+//
+#ifndef UFFD_ABORT_SIGNAL
+#define UFFD_ABORT_SIGNAL (SIGRTMAX-1)
+#endif
+
+
+
+
+// The number of transactions that can be active at once on a segment, unless stm_set_registry_size() says
+// otherwise when its metadata file is created.  Always rounded up to a multiple of 64.
+//
+#define MAX_ACTIVE_TRANSACTIONS 1024
+
+// The first word of a metadata file, so that files from older versions with a different layout are not used.
+//
+#define STM_METADATA_MAGIC 0x53544d41     // "STMA"
+
+// Fields of the metadata that different processes change often are kept this far apart, so that they are not
+// in the same cache line.
+//
+#define STM_CACHE_LINE 64
+
+// A slot in the active transaction registry holds this while its owner is getting its transaction ID, with the
+// owner's thread ID in the upper half of the slot, so that each claim of the slot can be told from the next.  A
+// slot that still holds the same claim after this many microseconds most likely belongs to a process that died,
+// and is reclaimed.
+//
+#define PENDING_TRANSACTION_ID ((transaction_id_t)-1)
+#define pending_word(tid) ((int64_t)(((uint64_t)(uint32_t)(tid) << 32) | PENDING_TRANSACTION_ID))
+#define is_pending_word(word) ((transaction_id_t)(word) == PENDING_TRANSACTION_ID)
+#ifndef STM_PENDING_WAIT_USEC
+#define STM_PENDING_WAIT_USEC 10000
+#endif
+
+// How often a transaction waiting for the irrevocable token, or holding it and waiting for commits to finish, checks
+// that whoever it is waiting for is still alive.
+//
+#ifndef STM_HOLDER_CHECK_USEC
+#define STM_HOLDER_CHECK_USEC 10000
+#endif
+
+// With the version clock (see stm_set_validation()), a transaction only gets a real ID if it has pages to lock
+// at commit.  Until then, this is its ID.
+//
+#define UNLOCKING_TRANSACTION_ID ((transaction_id_t)-2)
+
+// By default, this much of each segment's snapshot arena stays allocated between transactions.
+// See stm_set_snapshot_arena().
+//
+#ifndef STM_SNAPSHOT_HIGH_WATER
+#define STM_SNAPSHOT_HIGH_WATER (256*1024)
+#endif
+
+// Commits that write back more than this many bytes bypass the cache for the shared file.  Smaller ones leave
+// it in the cache, where other processes are likely to want it soon.
+//
+#ifndef STM_NONTEMPORAL_THRESHOLD
+#define STM_NONTEMPORAL_THRESHOLD (4*1024*1024)
+#endif
+
+// On a segment that can be read between transactions, pages a committed transaction only read are left readable
+// afterwards, with their versions, so that the next transaction can read them again without faulting, and a
+// transaction that only reads costs no system calls to commit.  If there are more of them than this, they are put
+// back the usual way instead.
+//
+#ifndef STM_WARM_PAGES
+#define STM_WARM_PAGES 64
+#endif
+
+// A transaction that finds a page locked by another one, which is most likely in the middle of committing, waits
+// for it to be unlocked rather than giving up right away:  first spinning this many times, and then asleep, for
+// at most this many microseconds in all.
+//
+#ifndef STM_PAGE_WAIT_SPINS
+#define STM_PAGE_WAIT_SPINS 100
+#endif
+#ifndef STM_PAGE_WAIT_USEC
+#define STM_PAGE_WAIT_USEC 1000
+#endif
+
+// Contention managers' waits shorter than this many nanoseconds are spent yielding the processor, not asleep.
+//
+#ifndef STM_SPIN_DELAY
+#define STM_SPIN_DELAY 50000
+#endif
+
+// By default, a transaction that has been retried this many times, or has been trying for this many nanoseconds,
+// becomes irrevocable.  See stm_set_irrevocable_after().
+//
+#ifndef STM_IRREVOCABLE_RETRIES
+#define STM_IRREVOCABLE_RETRIES 100
+#endif
+#ifndef STM_IRREVOCABLE_AGE
+#define STM_IRREVOCABLE_AGE 100000000L
+#endif
+
+// Each page keeps a contention score, which goes up by STM_CONTENTION_STEP, to at most STM_CONTENTION_MAX, each
+// time a transaction writing the page is aborted because somebody else wrote it, and down by one each time a
+// commit changes it, and for every STM_CONTENTION_DECAY commits to the segment since it last went up.  By default,
+// a page scoring at least this much is locked as soon as a transaction writes it, rather than at commit.  See
+// stm_set_eager_threshold().
+//
+#ifndef STM_EAGER_THRESHOLD
+#define STM_EAGER_THRESHOLD 8
+#endif
+#ifndef STM_CONTENTION_STEP
+#define STM_CONTENTION_STEP 4
+#endif
+#ifndef STM_CONTENTION_MAX
+#define STM_CONTENTION_MAX 32
+#endif
+#ifndef STM_CONTENTION_DECAY
+#define STM_CONTENTION_DECAY 16
+#endif
 
+// Admission control.  After every STM_ADMISSION_WINDOW commits and aborts on a segment, the number of
+// transactions let in on it at once is halved if at least half of them were aborts, and raised by one if fewer
+// than a quarter were.  A transaction waits at most STM_ADMISSION_WAIT_USEC microseconds to get in.  One that has
+// waited that long first takes back the places of processes that died while they were let in, and then goes in
+// anyway.  See stm_set_admission_control().
+//
+#ifndef STM_ADMISSION_WINDOW
+#define STM_ADMISSION_WINDOW 64
+#endif
+#ifndef STM_ADMISSION_WAIT_USEC
+#define STM_ADMISSION_WAIT_USEC 10000
+#endif
 
+// A nested transaction is retried by itself at most this many times in a row, before the transaction around it
+// is retried instead.  See stm_set_closed_nesting().
+//
+#ifndef STM_NESTED_RETRIES
+#define STM_NESTED_RETRIES 4
+#endif
 
-#define MAX_ACTIVE_TRANSACTIONS 100
+// The signal handler runs on its own stack, so that a transaction which has read inconsistent data and
+// recursed off the end of the stack can still be caught and retried.
+//
+#define STM_SIGNAL_STACK_SIZE (64*1024)
 
 
 // The structs used by stm.c are defined here and not in the header file, so they are opaque to other programs.
@@ -103,37 +274,118 @@
 // There's just one of these at the start of the metadata file associated with each shared segment
 //
 typedef struct transaction_data {
-    transaction_id_t  transaction_counter;              // global counter for transaction IDs in each segment
-    atomic_lock  transaction_lock;
-    int active_transaction_high_water;
-    transaction_id_t active_transactions[MAX_ACTIVE_TRANSACTIONS];
-    
+    int32_t magic;                                      // STM_METADATA_MAGIC
+    int32_t registry_slots;                             // size of the active transaction registry, which follows
+                                                        // the page table.  Fixed when the file is created.
+    int32_t validation;                                 // STM_VALIDATE_TRANSACTION_IDS or STM_VALIDATE_VERSION_CLOCK,
+                                                        // also fixed when the file is created.
+    int32_t visible_readers;                            // and whether transactions mark the pages they read
+    
+    // the rest each have a cache line to themselves
+    
+    transaction_id_t  transaction_counter               // global counter for transaction IDs in each segment
+        __attribute__((aligned(STM_CACHE_LINE)));
+    int32_t commit_sequence                             // bumped by every commit that writes pages, so that
+        __attribute__((aligned(STM_CACHE_LINE)));       // transactions reading shared pages know to revalidate
+    atomic_lock  transaction_lock                       // for changes to the metadata that have to be made all
+        __attribute__((aligned(STM_CACHE_LINE)));       // at once.  Not needed to start or commit transactions.
+    int32_t page_waiters                                // threads asleep waiting for some page to be unlocked,
+        __attribute__((aligned(STM_CACHE_LINE)));       // so that unlocking a page knows whether to wake them.
+    int64_t irrevocable_holder                          // the process and thread IDs of the holder of the
+        __attribute__((aligned(STM_CACHE_LINE)));       // irrevocable token, or 0
+    int32_t committers                                  // commits in progress that change pages, which an
+        __attribute__((aligned(STM_CACHE_LINE)));       // irrevocable transaction waits to finish
+    int32_t admitted                                    // transactions let in by admission control, and how
+        __attribute__((aligned(STM_CACHE_LINE)));       // many may be at once
+    int32_t admission_limit;
+    int32_t admission_waiters;                          // threads asleep waiting to be let in
+    int32_t admission_outcomes;                         // commits and aborts of transactions let in, and how
+    int32_t admission_aborts;                           // many of those in the current window were aborts
+    int32_t retry_waiters                               // threads asleep in stm_retry(), so that a commit
+        __attribute__((aligned(STM_CACHE_LINE)));       // knows to wake them as it changes pages
 } transaction_data;
 
+//
+// The active transaction registry, at the end of the metadata file, is a bitmap of the slots that are claimed,
+// followed by the slots, which hold the IDs of the active transactions in 64-bit words, so that there is room for
+// the claim in a pending one, and then a doomed flag for each slot.
+// After those, there are as many places for transactions let in by admission control, each holding the process
+// ID of the one in it, or 0, and then as many again for commits counted in committers.
+//
+#define registry_words(slots) ((slots)/64)
+#define registry_size(slots) (registry_words(slots) * sizeof(uint64_t) + \
+                              (slots) * (sizeof(int64_t) + 3 * sizeof(int32_t)))
+
+//
+// With visible readers, after the registry there is a 64-bit word for each page, in which each transaction that
+// reads the page sets bit (registry slot % 64).  Without them, the metadata file ends with the registry.
+//
+#define reader_bit(slot) ((int64_t)1 << ((slot) % 64))
+
 
 //
-// There is an array of these starting in the 2nd page of the metadata file.  Each one represents
-// the ID of a transaction currently modifying the page (if any), and keeps track of the most recent
-// transaction to have modified the page.
+// There is an array of these starting in the 2nd page of the metadata file.  Each one is a single word holding
+// the ID of a transaction currently modifying the page (if any), and the version of the page:  the most recent
+// transaction to have modified it, or with the version clock, the commit_sequence it committed at.  The owner
+// is nonzero exactly when the page is locked.  The word is always read all at once, and a commit locks a page
+// with a compare and swap on the whole word, so it only gets the lock if the version is still the one it expects,
+// and unlocks it and installs the new version with a single store.  IDs and versions wrap around, and are only
+// ever compared for equality, or by the sign of their difference.
+//
+// Next to the word is the page's contention score, and the segment's commit_sequence when it was last updated,
+// which the score decays from.  The score is only a heuristic, so these are updated without atomic operations,
+// and only when the score changes.
 //
 typedef struct page_table_element {
-    transaction_id_t  current_transaction;              // used to establish ownership of each page during commit
-    transaction_id_t  completed_transaction;                // used to keep a record of the last transaction to modify each page
+    int64_t page_word;
+    int32_t contention;
+    int32_t contention_sequence;
 } page_table_element;
 
+#define page_word(owner, version) ((int64_t)(((uint64_t)(owner) << 32) | (uint32_t)(version)))
+#define page_owner(word) ((transaction_id_t)((uint64_t)(word) >> 32))
+#define page_version(word) ((transaction_id_t)(word))
+#define read_page_word(elt) atomic_read_64(&(elt)->page_word)
+
+// The half of the word with the owner in it, for sleeping until the owner changes, and the half with the version,
+// for sleeping until the page is changed.
+//
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define page_owner_half(elt) ((uint32_t*)&(elt)->page_word + 1)
+#define page_version_half(elt) ((uint32_t*)&(elt)->page_word)
+#else
+#define page_owner_half(elt) ((uint32_t*)&(elt)->page_word)
+#define page_version_half(elt) ((uint32_t*)&(elt)->page_word + 1)
+#endif
+
 //
-// This represents a snapshot of a single page.  We take this snapshot on first access (read or write)
-// within a transaction.  These are kept in a list sorted by the page's virtual address, so that
-// it is easy to lock them in a known order during commit.
+// This represents a page accessed within a transaction.  We record one of these on first access
+// (read or write), but only take a snapshot of the page's contents on the first write.
+// These are kept in an array in the order the pages were first accessed, with an index by page number
+// so that faults can find them in constant time.  The array is sorted by the page's virtual address
+// before commit, so that it is easy to lock them in a known order.
 //
-typedef struct snapshot_list_element {
-    struct snapshot_list_element *next;
+typedef struct snapshot_element {
     void *original_page_va;                 // The virtual address where the "real" copy of this page lives
-    void *original_page_snapshot;           // copy of the unmodified page, on first access.
+    void *original_page_snapshot;           // copy of the unmodified page, on first write, in the snapshot arena.
+    int page_writable;                      // set once a write fault has given us a private, writable copy
     int page_dirty;                         // during commit, we set this if we have modified the page.
+    uint64_t *changed_lines;                // during commit, a bit for each cache line we have modified (see
+                                            // page_diff_copy() in pageops.h), alongside the snapshot buffer.
     transaction_id_t snapshot_transaction_id; // the most recent transaction to have affected the page,
                                             // at the time the snapshot is taken.
-} snapshot_list_element;
+    int nest_protected;                     // set if the page was writable, and has been write protected again
+                                            // since a nested transaction started, to catch its first write.
+} snapshot_element;
+
+//
+// A run of pages [va, va+len) in a shared segment.  Used to keep track of pages that were made accessible between
+// transactions.
+//
+typedef struct page_range {
+    void *va;
+    size_t len;
+} page_range;
 
 //
 // There is a global stack that keeps track of nested transactions.  We only really commit changes when we commit
@@ -142,8 +394,23 @@ typedef struct snapshot_list_element {
 typedef struct transaction_stack_element {
     struct transaction_stack_element *next;
     char *transaction_name;
+    int retryable;                          // nested transactions only:  set if a conflict can retry just this
+    sigjmp_buf retry_buf;                   // one, from here,
+    int retries;                            // which it has this many times in a row
+    int abandoned;                          // the error its commit fails with, if a nested transaction in it
+                                            // was abandoned and couldn't be undone cleanly
 } transaction_stack_element;
 
+//
+// Where a segment's snapshot set, snapshot arena and pre-images stood when a nested transaction started, so
+// that it can be undone by itself.
+//
+typedef struct nesting_mark {
+    int n_snapshots;
+    size_t arena_used;
+    int n_preimages;
+} nesting_mark;
+
 
 //
 // This data structure represents a shared memory area and the metadata that goes with it.
@@ -166,28 +433,99 @@ typedef struct shared_segment {
     
     size_t shared_seg_size;                                 // size of the shared memory area
     void *shared_base_va;                                   // first virtual address of the shared memory area
+    void *shared_view_va;                                   // the same file, always mapped shared and writable.
+                                                            // Commits write dirty pages through this.
     
     size_t transaction_data_size;                           // size of the metadata area in memory
     struct transaction_data *segment_transaction_data;      // the "control" information for all transactions on this 
                                                             // shared segment.
     struct page_table_element *segment_page_table;          // the page table describing transactions on this segment
     
-    transaction_id_t transaction_id;                        // current transaction ID, if any 
-    struct snapshot_list_element *snapshot_list;            // list of snapshotted pages accessed during a transaction
-    struct snapshot_list_element *snapshot_pool;            // place to put snapshot list elements we're done with instead
-                                                            // of freeing and reallocating later.
+    transaction_id_t transaction_id;                        // current transaction ID, if any.  Segments join the
+                                                            // thread's transaction on the first fault in it.
+    int in_transaction;                                     // nonzero while the thread is in a transaction this
+                                                            // segment takes part in, touched yet or not.
+    struct snapshot_element *snapshots;                     // pages accessed during a transaction, room for one.
+                                                            // Between transactions, the warm pages still readable.
+    int n_snapshots;                                        // per page of the segment, mapped like snapshot_index
+    int snapshots_sorted;                                   // nonzero if snapshots are in ascending address order
+    uint32_t *snapshot_index;                               // for each page of the segment, 1 + its position in
+                                                            // snapshots, or 0 if it hasn't been accessed.
+    
+    void *snapshot_arena;                                   // page-aligned snapshot buffers, one per page written in
+    size_t arena_used;                                      // a transaction.  Buffers are handed out in order, and
+    size_t arena_peak;                                      // all given back at the end of the transaction.
+    size_t arena_high_water;                                // pages of the arena kept between transactions; those
+                                                            // above this are given back to the kernel.
+    uint64_t *line_masks;                                   // changed_lines for each buffer in the arena.
+    int merge_mode;                                         // see stm_set_merge_mode()
+    
+    nesting_mark *nesting_marks;                            // one for each retryable nested transaction going on,
+    int n_nesting_marks;                                    // innermost last
+    int max_nesting_marks;
+    void *preimage_arena;                                   // copies of pages written before a nested transaction
+    uint32_t *preimage_pages;                               // started, as they were then, and the position in
+    int n_preimages;                                        // snapshots of each one's page.  Room for one per page
+    int preimages_overflowed;                               // of the segment; if that runs out, this is set, and
+                                                            // nested transactions can't be undone by themselves.
+    
+    int32_t validated_sequence;                             // commit_sequence when the pages we have read were last
+                                                            // known to be unchanged.  With the version clock, this is
+                                                            // the transaction's read version.
+    int32_t commit_version;                                 // commit_sequence as bumped by our commit, which with the
+                                                            // version clock is the version of the pages it writes
+    int validation;                                         // from the metadata file's transaction_data
     
     int n_prior_active_transactions;                        // number of transactions active at the time the current one
                                                             // started.
-    transaction_id_t prior_active_transactions[MAX_ACTIVE_TRANSACTIONS];
-                                                            // array of transaction IDs of transactions active at the time
-                                                            // the current one started.
+    transaction_id_t *prior_active_transactions;            // array of transaction IDs of transactions active at
+                                                            // the time the current one started, in ascending order.
+    
+    int registry_slots;                                     // the active transaction registry in the metadata file:
+    uint64_t *registry_claimed;                             // a bit for each slot that is in use,
+    int64_t *registry_ids;                                  // and the slots themselves,
+    int32_t *registry_doomed;                               // and whether each one's transaction has been doomed.
+    int registry_slot;                                      // our slot, while a transaction is active,
+    int64_t registry_claim;                                 // and what it holds until our ID is filled in
+    int retry_waiting;                                      // set while we are counted in retry_waiters
+    
+    int visible_readers;                                    // from the metadata file's transaction_data
+    int64_t *page_readers;                                  // the reader bits for each page
+    
+    int irrevocable;                                        // nonzero while we hold the irrevocable token
+    int committing;                                         // nonzero while we are counted in committers,
+    int committer_place;                                    // and our place in committer_pids, or -1 if none
+    int32_t *committer_pids;                                // the places for commits under way, in the registry
+    int admitted;                                           // nonzero while we are counted in admitted,
+    int admission_place;                                    // and our place in admission_pids, or -1 if none
+    int32_t *admission_pids;                                // the places for transactions let in, in the registry
         
     void *free_list_addr;                                  // if stmalloc is in use, this points to the free list header
+    
+    int engine;                                             // STM_ENGINE_SIGNAL or STM_ENGINE_USERFAULTFD
+    page_range *granted_ranges;                             // pages made accessible between transactions, sorted by
+                                                            // address with adjacent runs merged.  Access to these is
+                                                            // taken away again when the next transaction starts.
+    int n_granted_ranges;
+    int max_granted_ranges;
+    struct shared_segment *uffd_next;                       // userfaultfd only:  link on the list of all such
+                                                            // segments, which the fault handling thread searches
 } shared_segment;
 
 
 static int stm_verbose;
+static int stm_fault_engine = STM_ENGINE_SIGNAL;           // fault engine for segments opened from now on
+static int stm_registry_slots = MAX_ACTIVE_TRANSACTIONS;    // registry size for metadata files created from now on
+static int stm_validation = STM_VALIDATE_TRANSACTION_IDS;   // and their validation scheme
+static int stm_visible_readers;                             // and whether they have visible readers
+static int stm_irrevocable_retries = STM_IRREVOCABLE_RETRIES;
+static long stm_irrevocable_age = STM_IRREVOCABLE_AGE;
+static int stm_eager_threshold = STM_EAGER_THRESHOLD;
+static int stm_admission_control = 0;
+static int stm_closed_nesting = 1;
+#ifdef HAVE_USERFAULTFD
+static int uffd = -1;                                       // the process's userfaultfd, once there is one
+#endif
 
 // There used to be more globals, but now they are in thread-local storage
 //
@@ -202,6 +540,30 @@ static pthread_key_t transaction_stack_key;
 static pthread_key_t stm_jmp_buf_key;
 static pthread_key_t stm_errno_key;
 
+static __thread stack_t signal_stack;
+
+// The stack element for the nested transaction the thread is about to start, or start again, which holds the
+// context it is retried from.
+//
+static __thread transaction_stack_element *pending_transaction;
+
+// Nonzero in the thread that serves the userfaultfd, which must not sit waiting for anything, since every fault in
+// the process waits for it.
+//
+static __thread int in_uffd_handler;
+
+// The attempts at the thread's current outermost transaction, for its contention manager.
+//
+static __thread struct {
+    struct timespec started;        // when the first attempt started
+    int retries;
+    long karma;                     // pages touched by the attempts that were aborted
+    uint32_t seed;                  // for jitter
+    int irrevocable;                // nonzero if the next attempt, or this one from now on, is irrevocable
+    int reason;                     // stm_errno when the last attempt was aborted
+    long timeout;                   // nanoseconds from started to give up at, or 0, for stm_retry()
+} contention;
+
 
 
 static shared_segment *shared_segment_list() {
@@ -222,12 +584,12 @@ static void set_transaction_stack(transaction_stack_element *trans) {
 }
 
 // This one has to be global scope so clients can use it.
-jmp_buf *stm_jmp_buf() {
-    return (jmp_buf *)pthread_getspecific(stm_jmp_buf_key);
+sigjmp_buf *stm_jmp_buf() {
+    return (sigjmp_buf *)pthread_getspecific(stm_jmp_buf_key);
 }
 
 
-void set_stm_jmp_buf(jmp_buf *jb) {
+void set_stm_jmp_buf(sigjmp_buf *jb) {
     pthread_setspecific(stm_jmp_buf_key, jb);
 }
 
@@ -257,90 +619,161 @@ void stm_init_thread_locals()
     set_transaction_stack(NULL);
     set_stm_errno(0);
     
-    set_stm_jmp_buf(calloc(1, sizeof(jmp_buf)));
+    set_stm_jmp_buf(calloc(1, sizeof(sigjmp_buf)));
     
+    if (signal_stack.ss_sp == NULL) {
+        stack_t ss;
+        ss.ss_size = STM_SIGNAL_STACK_SIZE;
+        ss.ss_flags = 0;
+        if ((ss.ss_sp = malloc(ss.ss_size)) != NULL && sigaltstack(&ss, NULL) == 0)
+            signal_stack = ss;
+    }
 }
 
 
 //
-// The next few routines manage a shared list of active transaction IDs in the metadata segment.  
+// The next few routines manage the registry of active transaction IDs in the metadata segment.
+// A slot is claimed by setting its bit in the bitmap, starting from a word picked by the CPU we are running on,
+// so that processes don't all compete for the same words.  No lock is needed:  the slot holds
+// PENDING_TRANSACTION_ID while its owner gets its transaction ID, and anybody taking a snapshot of the registry
+// waits for that to be filled in, so no transaction with a lower ID than ours can be missed.  If it isn't filled
+// in for too long, the slot is taken back, and its owner, if it is still alive after all, has to start again.
 //
-static void add_active_transaction(shared_segment *seg) {
-    int i, high_water;
-    transaction_data *td;
-    
-    td = seg->segment_transaction_data;
-    for (high_water = td->active_transaction_high_water; 
-         high_water < MAX_ACTIVE_TRANSACTIONS; 
-         high_water = atomic_increment_32(&td->active_transaction_high_water)) {
-        
-        if (high_water >= MAX_ACTIVE_TRANSACTIONS)
-            break;  // could happen despite 'for' condition because of multiple processes accessing concurrently
 
+int32_t stale_slots;                                         // registry slots taken back from owners that took too long
 
-        for (i = high_water - 1; i >= 0; i--) {
-            if (atomic_compare_and_swap_32(0, seg->transaction_id,
-                                           (int32_t*)&(td->active_transactions[i]))) {
-                return;
-            }           
-        }
+static int32_t thread_id() {
+    return syscall(SYS_gettid);
+}
+
+static int registry_hint(shared_segment *seg) {
+#ifdef __linux__
+    int cpu = sched_getcpu();
     
+    if (cpu >= 0)
+        return cpu % registry_words(seg->registry_slots);
+#endif
+    return getpid() % registry_words(seg->registry_slots);
+}
+
+// Returns 0, or -1 if every slot is in use.
+//
+static int add_active_transaction(shared_segment *seg) {
+    int i, w, bit, n_words = registry_words(seg->registry_slots);
+    uint64_t word;
+    
+    for (i = 0, w = registry_hint(seg); i < n_words; i++, w = (w + 1) % n_words) {
+        while ((word = seg->registry_claimed[w]) != ~(uint64_t)0) {
+            bit = __builtin_ctzll(~word);
+            if (atomic_compare_and_swap_64(word, word | ((uint64_t)1 << bit), (int64_t*)&seg->registry_claimed[w])) {
+                seg->registry_slot = w * 64 + bit;
+                seg->registry_claim = pending_word(thread_id());
+                atomic_swap_64(seg->registry_claim, &seg->registry_ids[seg->registry_slot]);
+                seg->registry_doomed[seg->registry_slot] = 0;
+                return 0;
+            }
+        }
     }
     
     if (stm_verbose & 1)
-        fprintf(stderr, "add_active_transaction:  Too many active transactions; recompile for larger number!\n");
-    exit(-1);
-    // *** Is there a more graceful way to handle this case?  There must be, but it eludes me.
+        fprintf(stderr, "add_active_transaction:  Too many active transactions; use stm_set_registry_size()\n");
+    return -1;
+}
+
+static void release_registry_slot(shared_segment *seg, int slot) {
+    int w = slot / 64;
+    uint64_t word, bit = (uint64_t)1 << (slot % 64);
     
+    do {
+        word = seg->registry_claimed[w];
+    } while (!atomic_compare_and_swap_64(word, word & ~bit, (int64_t*)&seg->registry_claimed[w]));
 }
 
 static void delete_active_transaction(shared_segment *seg) {
-    int i;
-    transaction_data *td;
+    if (seg->registry_slot < 0)
+        return;
     
-    td = seg->segment_transaction_data;
-    for (i = 0; i < td->active_transaction_high_water; i++) {
-        if (td->active_transactions[i] == seg->transaction_id) {
-            td->active_transactions[i] = 0;
-                        
-#if 0
-            // *** Functionally this is not necessary.  If not decremented it will truly be the
-            // "high water" mark and will just contain some empty elements.
-            
-            if (i == td->active_transaction_high_water - 1) {       
-                atomic_decrement_32(&td->active_transaction_high_water);        
-            }   
+    atomic_swap_64(0, &seg->registry_ids[seg->registry_slot]);
+    release_registry_slot(seg, seg->registry_slot);
+    seg->registry_slot = -1;
+}
 
-#endif
-            return;
-        }           
+// Wait for the owner of a slot to fill in its transaction ID.  Returns the ID, or 0 if the slot has been taken
+// back from an owner that took too long.  A slot is only taken back if it still holds the claim that was waited
+// for, not one made since by somebody else after it was taken back once already.  The userfaultfd thread doesn't
+// wait, and gets PENDING_TRANSACTION_ID back instead.
+//
+static transaction_id_t wait_for_pending_slot(shared_segment *seg, int slot) {
+    int64_t *id = &seg->registry_ids[slot];
+    int64_t word, claim = 0;
+    struct timespec start, now;
+    long waited = 0;
+    
+    while (is_pending_word(word = atomic_read_64(id))) {
+        if (in_uffd_handler)
+            return PENDING_TRANSACTION_ID;
+        if (word != claim) {
+            claim = word;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            waited = 0;
+        } else if (waited >= STM_PENDING_WAIT_USEC) {
+            if (atomic_compare_and_swap_64(claim, 0, id)) {
+                atomic_increment_32(&stale_slots);
+                release_registry_slot(seg, slot);
+                return 0;
+            }
+            continue;
+        }
+        sched_yield();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
     }
+    return (transaction_id_t)word;
 }
 
+static int compare_transaction_ids(const void *a, const void *b) {
+    transaction_id_t ta = *(const transaction_id_t *)a, tb = *(const transaction_id_t *)b;
+    
+    return (ta < tb) ? -1 : (ta > tb);
+}
 
-
-static void snapshot_active_transactions(shared_segment *seg) {
-    int i;
-    transaction_data *td;
+// Returns 0, or 1 if it would have to wait for a slot and can't, because this is the userfaultfd thread.
+//
+static int snapshot_active_transactions(shared_segment *seg) {
+    int w, bit, slot;
+    uint64_t word;
+    transaction_id_t id;
     
-    td = seg->segment_transaction_data;
     seg->n_prior_active_transactions = 0;
     
-    for (i = 0; i < td->active_transaction_high_water; i++) {
-        if (td->active_transactions[i] != 0 && td->active_transactions[i] != seg->transaction_id) {
-            seg->prior_active_transactions[seg->n_prior_active_transactions++] = td->active_transactions[i];
-        }           
-    }       
+    for (w = 0; w < registry_words(seg->registry_slots); w++) {
+        for (word = seg->registry_claimed[w]; word; word &= word - 1) {
+            bit = __builtin_ctzll(word);
+            slot = w * 64 + bit;
+            if (slot == seg->registry_slot)
+                continue;
+            if ((id = wait_for_pending_slot(seg, slot)) == PENDING_TRANSACTION_ID)
+                return 1;
+            if (id != 0)
+                seg->prior_active_transactions[seg->n_prior_active_transactions++] = id;
+        }
+    }
+    
+    qsort(seg->prior_active_transactions, seg->n_prior_active_transactions, sizeof(transaction_id_t),
+          compare_transaction_ids);
+    return 0;
 }
 
 static int find_prior_active_transaction(shared_segment *seg, transaction_id_t trans) {
-    int i;
-    for (i = 0; i < seg->n_prior_active_transactions; i++) {
-        if (seg->prior_active_transactions[i] == trans) {
-            return 1;
-        }           
-    }
-    return 0;
+    return bsearch(&trans, seg->prior_active_transactions, seg->n_prior_active_transactions,
+                   sizeof(transaction_id_t), compare_transaction_ids) != NULL;
+}
+
+void print_lock_stats(shared_segment *seg) {
+    uint32_t acquired, contended, slept;
+    
+    atomic_spin_lock_stats(&seg->segment_transaction_data->transaction_lock, &acquired, &contended, &slept);
+    printf("transaction_lock: acquired %u, contended %u, slept %u\n", acquired, contended, slept);
 }
 
 void print_snapshot_active_transactions(shared_segment *seg) {
@@ -362,7 +795,7 @@ static int check_file_length(int fd, size_t length, ino_t *inode) {
             fprintf(stderr, "check_file_length: bad filetype");
         set_stm_errno(STM_FILETYPE_ERROR);
         return -1;
-    } else if (length > sbuf.st_size) {
+    } else if ((off_t)length > sbuf.st_size) {
         //      fprintf(stderr, "file too short\n");
         if (ftruncate(fd, length) == -1) {
             if (stm_verbose & 1)
@@ -376,10 +809,58 @@ static int check_file_length(int fd, size_t length, ino_t *inode) {
 
 
 
+#ifdef HAVE_USERFAULTFD
+
+static shared_segment *uffd_segments;          // all userfaultfd segments of all threads, linked by uffd_next
+static pthread_mutex_t uffd_segments_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int init_userfaultfd();
+
+
+// Returns with uffd_segments_lock held, whether or not the segment is found, so that the segment can't be closed
+// while its fault is being handled.
+//
+static shared_segment *lock_uffd_segment(void *va) {
+    shared_segment *seg;
+    
+    pthread_mutex_lock(&uffd_segments_lock);
+    for (seg = uffd_segments; seg; seg = seg->uffd_next) {
+        if (seg->shared_base_va <= va &&
+            va < seg->shared_base_va + seg->shared_seg_size)
+            break;
+    }
+    return seg;
+}
+
+static void register_uffd_segment(shared_segment *seg) {
+    pthread_mutex_lock(&uffd_segments_lock);
+    seg->uffd_next = uffd_segments;
+    uffd_segments = seg;
+    pthread_mutex_unlock(&uffd_segments_lock);
+}
+
+static void unregister_uffd_segment(shared_segment *seg) {
+    shared_segment **s;
+    
+    pthread_mutex_lock(&uffd_segments_lock);
+    for (s = &uffd_segments; *s; s = &(*s)->uffd_next) {
+        if (*s == seg) {
+            *s = seg->uffd_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&uffd_segments_lock);
+}
+
+#endif // HAVE_USERFAULTFD
+
+
+
 shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, void *requested_va, int prot_flags) {
     void *status;
     int mmap_flags;
     int metadata_size;
+    size_t readers_offset, registry_offset;
     shared_segment *s, *prev;
     static const char *metadata_suffix = ".metadata";
     
@@ -418,9 +899,21 @@ shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, voi
     seg->page_size = getpagesize();
     
     metadata_size = seg->page_size;
-    while (metadata_size < sizeof(transaction_data))
+    while (metadata_size < (int)sizeof(transaction_data))
         metadata_size += seg->page_size;
-    seg->transaction_data_size = ((segment_size/seg->page_size) * sizeof(page_table_element)) + metadata_size;
+    
+    // The registry and then the reader bits, if there are any, go after the page table, on cache line
+    // boundaries.  If the metadata file already exists, the size of the registry and whether there are reader
+    // bits are only a guess, until we can look.
+    
+    registry_offset = ((segment_size/seg->page_size) * sizeof(page_table_element) + metadata_size + 63) & ~63;
+    seg->registry_slots = stm_registry_slots;
+    seg->registry_slot = -1;
+    seg->visible_readers = stm_visible_readers;
+    readers_offset = (registry_offset + registry_size(seg->registry_slots) + 63) & ~63;
+    seg->transaction_data_size = seg->visible_readers ?
+        readers_offset + (segment_size/seg->page_size) * sizeof(int64_t) :
+        registry_offset + registry_size(seg->registry_slots);
     
     if ((seg->metadata_fd = open(seg->metadata_filename, O_RDWR|O_CREAT, 0777)) < 0) {
         if (stm_verbose & 1)
@@ -438,6 +931,7 @@ shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, voi
     }
     
     seg->default_prot_flags = prot_flags;
+    seg->engine = stm_fault_engine;
     
 
 #ifdef PRIVATE_MAPPING_IS_PRIVATE
@@ -449,7 +943,16 @@ shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, voi
     if (requested_va != NULL)
         mmap_flags |= MAP_FIXED;
     
-    status = mmap(requested_va, seg->shared_seg_size, seg->default_prot_flags, mmap_flags, seg->fd, (off_t)0);  
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD) {
+        // Nothing is mapped here from the file.  Every page is brought in by the fault handling thread.
+        status = mmap(requested_va, seg->shared_seg_size, PROT_READ|PROT_WRITE,
+                      (mmap_flags & MAP_FIXED)|MAP_PRIVATE|MAP_ANONYMOUS, -1, (off_t)0);
+    } else
+#endif
+    // The segment starts out inaccessible; pages are made accessible as they are touched.  See
+    // outside_transaction_fault().
+    status = mmap(requested_va, seg->shared_seg_size, PROT_NONE, mmap_flags, seg->fd, (off_t)0);  
     
     if (status != (void*)-1) {
         seg->shared_base_va = status;   
@@ -463,6 +966,18 @@ shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, voi
     }   
     
     
+    status = mmap(0, seg->shared_seg_size, PROT_READ|PROT_WRITE, MAP_SHARED, seg->fd, (off_t)0);
+    
+    if (status != (void*)-1) {
+        seg->shared_view_va = status;
+    } else {
+        if (stm_verbose & 1)
+            perror("stm_open_shared_segment: error mapping shared view of segment");
+        set_stm_errno(STM_MMAP_ERROR);
+        stm_close_shared_segment(seg);
+        return NULL;
+    }
+    
     status = mmap(0, seg->transaction_data_size, PROT_READ|PROT_WRITE, MAP_SHARED, seg->metadata_fd, (off_t)0); 
     
     if (status != (void*)-1) {
@@ -476,6 +991,129 @@ shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, voi
         return NULL;
     }
     
+    // Whoever gets here first with a new metadata file sets it up, and decides the size of the registry.  Don't
+    // go near the lock if this is obviously a file in some other format.  The lock is held only for the few stores
+    // below, so if a process died holding it (or waiting for it), the ticket lock's timeout skips the dead ticket;
+    // the setup is guarded by the magic number, so it's harmless if that ever lets two processes in at once.
+    
+    if (seg->segment_transaction_data->magic == 0) {
+        atomic_spin_lock_lock(&seg->segment_transaction_data->transaction_lock);
+        if (seg->segment_transaction_data->magic == 0) {
+            seg->segment_transaction_data->registry_slots = seg->registry_slots;
+            seg->segment_transaction_data->validation = stm_validation;
+            seg->segment_transaction_data->visible_readers = stm_visible_readers;
+            seg->segment_transaction_data->admission_limit = seg->registry_slots;
+            seg->segment_transaction_data->magic = STM_METADATA_MAGIC;
+        }
+        atomic_spin_lock_unlock(&seg->segment_transaction_data->transaction_lock);
+    }
+    
+    if (seg->segment_transaction_data->magic != STM_METADATA_MAGIC) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "stm_open_shared_segment: metadata file %s is not in the current format\n",
+                    seg->metadata_filename);
+        set_stm_errno(STM_FILETYPE_ERROR);
+        stm_close_shared_segment(seg);
+        return NULL;
+    }
+    
+    seg->validation = seg->segment_transaction_data->validation;
+    
+    if (seg->segment_transaction_data->registry_slots != seg->registry_slots ||
+        seg->segment_transaction_data->visible_readers != seg->visible_readers) {
+        seg->registry_slots = seg->segment_transaction_data->registry_slots;
+        seg->visible_readers = seg->segment_transaction_data->visible_readers;
+        munmap(seg->segment_transaction_data, seg->transaction_data_size);
+        seg->segment_transaction_data = NULL;
+        readers_offset = (registry_offset + registry_size(seg->registry_slots) + 63) & ~63;
+        seg->transaction_data_size = seg->visible_readers ?
+            readers_offset + (segment_size/seg->page_size) * sizeof(int64_t) :
+            registry_offset + registry_size(seg->registry_slots);
+        
+        if (check_file_length(seg->metadata_fd, seg->transaction_data_size, NULL) ||
+            (status = mmap(0, seg->transaction_data_size, PROT_READ|PROT_WRITE, MAP_SHARED, seg->metadata_fd,
+                           (off_t)0)) == (void*)-1) {
+            if (stm_verbose & 1)
+                perror("stm_open_shared_segment: error mapping shared metadata segment");
+            set_stm_errno(STM_MMAP_ERROR);
+            stm_close_shared_segment(seg);
+            return NULL;
+        }
+        seg->segment_transaction_data = (transaction_data *)status;
+        seg->segment_page_table = (page_table_element*)((void*)seg->segment_transaction_data + metadata_size);
+    }
+    
+    seg->registry_claimed = (void*)seg->segment_transaction_data + registry_offset;
+    seg->registry_ids = (int64_t*)(seg->registry_claimed + registry_words(seg->registry_slots));
+    seg->registry_doomed = (int32_t*)(seg->registry_ids + seg->registry_slots);
+    seg->admission_pids = seg->registry_doomed + seg->registry_slots;
+    seg->committer_pids = seg->admission_pids + seg->registry_slots;
+    if (seg->visible_readers)
+        seg->page_readers = (void*)seg->segment_transaction_data + readers_offset;
+    
+    if ((seg->prior_active_transactions = calloc(seg->registry_slots, sizeof(transaction_id_t))) == NULL) {
+        set_stm_errno(STM_ALLOC_ERROR);
+        stm_close_shared_segment(seg);
+        return NULL;
+    }
+    
+    // The index of accessed pages, the snapshot set, and the snapshot arena are each big enough for a transaction
+    // that touches every page of the segment.  They are mapped rather than allocated, so that only the parts
+    // that are actually used take up any memory, and so that nothing has to be allocated during a page fault.
+    
+    seg->snapshot_index = mmap(0, (segment_size/seg->page_size) * sizeof(uint32_t), PROT_READ|PROT_WRITE,
+                               MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, (off_t)0);
+    seg->snapshots = mmap(0, (segment_size/seg->page_size) * sizeof(snapshot_element), PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, (off_t)0);
+    seg->snapshot_arena = mmap(0, segment_size, PROT_READ|PROT_WRITE,
+                               MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, (off_t)0);
+    seg->line_masks = mmap(0, (segment_size/seg->page_size) * PAGEOPS_MASK_WORDS(seg->page_size) * sizeof(uint64_t),
+                           PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, (off_t)0);
+    seg->preimage_arena = mmap(0, segment_size, PROT_READ|PROT_WRITE,
+                               MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, (off_t)0);
+    seg->preimage_pages = mmap(0, (segment_size/seg->page_size) * sizeof(uint32_t), PROT_READ|PROT_WRITE,
+                               MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, (off_t)0);
+    seg->snapshots_sorted = 1;
+    seg->arena_high_water = STM_SNAPSHOT_HIGH_WATER / seg->page_size;
+    
+    if (seg->snapshot_index == (void*)-1 || seg->snapshots == (void*)-1 || seg->snapshot_arena == (void*)-1 ||
+        seg->line_masks == (void*)-1 || seg->preimage_arena == (void*)-1 || seg->preimage_pages == (void*)-1) {
+        if (stm_verbose & 1)
+            perror("stm_open_shared_segment: error mapping snapshot set");
+        if (seg->snapshot_index == (void*)-1) seg->snapshot_index = NULL;
+        if (seg->snapshots == (void*)-1) seg->snapshots = NULL;
+        if (seg->snapshot_arena == (void*)-1) seg->snapshot_arena = NULL;
+        if (seg->line_masks == (void*)-1) seg->line_masks = NULL;
+        if (seg->preimage_arena == (void*)-1) seg->preimage_arena = NULL;
+        if (seg->preimage_pages == (void*)-1) seg->preimage_pages = NULL;
+        set_stm_errno(STM_ALLOC_ERROR);
+        stm_close_shared_segment(seg);
+        return NULL;
+    }
+    
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD) {
+        struct uffdio_register reg;
+        
+        reg.range.start = (unsigned long)seg->shared_base_va;
+        reg.range.len = seg->shared_seg_size;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING|UFFDIO_REGISTER_MODE_WP;
+        if (init_userfaultfd() != 0) {
+            set_stm_errno(STM_ENGINE_ERROR);
+            stm_close_shared_segment(seg);
+            return NULL;
+        }
+        if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+            if (stm_verbose & 1)
+                perror("stm_open_shared_segment: error registering segment with userfaultfd");
+            set_stm_errno(STM_ENGINE_ERROR);
+            stm_close_shared_segment(seg);
+            return NULL;
+        }
+        register_uffd_segment(seg);
+    }
+#endif
+    
     // Don't link this onto the segment list until the end, so we don't have to undo it if there is an error
     // above.   And insert it into the segment list in ascending inode order.  Inodes should be unique and stable,
     // so each process using a set of mapped files will be able to list them in the same order, avoiding livelocks
@@ -502,114 +1140,508 @@ shared_segment *stm_open_shared_segment(char *filename, size_t segment_size, voi
 
 
 
-#define n_histo_buckets 9
+#define n_histo_buckets 10
 int collision_histo[n_histo_buckets];
 
+// These are shared by all the threads of the process, and so are incremented atomically.
+int32_t merged_pages;                                       // collisions avoided by merge mode
+int32_t page_waits;                                         // times a transaction waited for a page to be unlocked
+int32_t page_waits_unlocked;                                // and it was unlocked in time
+int32_t doomed_transactions;                                // times a commit doomed another transaction
+int32_t unchecked_validations;                              // times visible readers saved looking at the read set
+int32_t irrevocable_transactions;                           // transactions that became irrevocable
+int32_t eager_locks;                                        // pages locked when written rather than at commit
+int32_t admission_waits;                                    // times a transaction waited to be let in
+int32_t admission_timeouts;                                 // and was let in anyway, having waited too long
+int32_t dead_admissions;                                    // admission places taken back from dead processes
+int32_t dead_committers;                                    // commits given up on because their processes died
+int32_t nested_retries;                                     // times a nested transaction was retried by itself
+int32_t retry_waits;                                        // times stm_retry() waited for a change
+
 void print_collision_histo() {
     int i;
     printf("collision histogram:\n");
     for (i=0; i<n_histo_buckets; i++) {
         printf("%d\t\%d\n", i, collision_histo[i]);
     }
+    if (merged_pages)
+        printf("merged\t%d\n", merged_pages);
+    if (page_waits)
+        printf("waited\t%d (%d unlocked)\n", page_waits, page_waits_unlocked);
+    if (doomed_transactions || unchecked_validations)
+        printf("doomed\t%d (%d unchecked)\n", doomed_transactions, unchecked_validations);
+    if (irrevocable_transactions || dead_committers)
+        printf("irrevocable\t%d (%d dead committers)\n", irrevocable_transactions, dead_committers);
+    if (eager_locks)
+        printf("eager\t%d\n", eager_locks);
+    if (admission_waits || dead_admissions)
+        printf("admission\t%d (%d timed out, %d taken back)\n", admission_waits, admission_timeouts, dead_admissions);
+    if (nested_retries)
+        printf("nested\t%d\n", nested_retries);
+    if (retry_waits)
+        printf("retry\t%d\n", retry_waits);
+    if (stale_slots)
+        printf("stale slots\t%d\n", stale_slots);
 }
 
 
 
 
-static void free_snapshot_list(shared_segment *seg) {
+// Empty the snapshot set at the end of a transaction.  Only the index entries of the pages accessed are
+// cleared, so this is proportional to the number of pages the transaction touched.
+//
+static void release_snapshot_arena(shared_segment *seg);
+
+static void clear_snapshot_set(shared_segment *seg) {
+    snapshot_element *sl;
     
-    snapshot_list_element *sl, *prev = NULL;
-    for (sl = seg->snapshot_list; sl; prev = sl, sl = sl->next) {
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+        seg->snapshot_index[(sl->original_page_va - seg->shared_base_va)/seg->page_size] = 0;
         sl->original_page_va = NULL;
+        sl->original_page_snapshot = NULL;
+        sl->changed_lines = NULL;
         sl->snapshot_transaction_id = 0;
+        sl->page_writable = 0;
         sl->page_dirty = 0;
+        sl->nest_protected = 0;
     }
+    seg->n_snapshots = 0;
+    seg->snapshots_sorted = 1;
     
-    if (prev != NULL)
-        prev->next = seg->snapshot_pool;
-    seg->snapshot_pool = seg->snapshot_list;
-    seg->snapshot_list = NULL;
-        
+    release_snapshot_arena(seg);
 }
 
-static void free_snapshot_pool(shared_segment *seg) {
-    snapshot_list_element *sl;
-    for ( ; seg->snapshot_pool; seg->snapshot_pool = sl) {
-        sl = seg->snapshot_pool->next;
-        if (seg->snapshot_pool->original_page_va)
-            free(seg->snapshot_pool->original_page_snapshot);
-        free(seg->snapshot_pool);       
+// Drop one page from the snapshot set, by moving the last one into its place.
+//
+static void drop_snapshot_element(shared_segment *seg, snapshot_element *sl) {
+    snapshot_element *last = &seg->snapshots[seg->n_snapshots - 1];
+    
+    seg->snapshot_index[(sl->original_page_va - seg->shared_base_va)/seg->page_size] = 0;
+    if (sl != last) {
+        *sl = *last;
+        seg->snapshot_index[(sl->original_page_va - seg->shared_base_va)/seg->page_size] = sl - seg->snapshots + 1;
+        seg->snapshots_sorted = 0;
     }
-}    
-
+    memset(last, 0, sizeof(snapshot_element));
+    seg->n_snapshots--;
+}
 
-static void abort_transaction_on_segment(shared_segment *seg) {
-    snapshot_list_element *sl;
-    size_t page_num;
-    page_table_element *page_table_elt;
-    void *status;
+// At the end of a committed transaction, keep just the pages it only read, as the warm pages.
+//
+static void keep_warm_pages(shared_segment *seg) {
+    snapshot_element *sl;
     
-    if (seg->transaction_id == 0) {
-        if (stm_verbose & 2)
-            fprintf(stderr, "Aborting transaction but transaction_id is already 0\n");
-        return;
+    for (sl = seg->snapshots + seg->n_snapshots - 1; sl >= seg->snapshots; sl--) {
+        if (sl->page_writable)
+            drop_snapshot_element(seg, sl);
     }
+    release_snapshot_arena(seg);
+}
+
+static void release_snapshot_arena(shared_segment *seg) {
     
-    if (stm_verbose & 4)
-        fprintf(stderr, "Aborting Transaction %d [", seg->transaction_id);
+    // Give back the snapshot buffers.  If a big transaction took the arena past its high water mark, let the
+    // kernel have the excess, so that memory use comes back down once such transactions are over.
     
-    delete_active_transaction(seg);
+    if (seg->arena_used > seg->arena_peak)
+        seg->arena_peak = seg->arena_used;
+    seg->arena_used = 0;
+    seg->n_preimages = 0;
+    seg->preimages_overflowed = 0;
     
-    for(sl = seg->snapshot_list; sl; sl = sl->next) {
-
-        page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;         
-        page_table_elt = &(seg->segment_page_table[page_num]);
-        
-        if (stm_verbose & 4) {
-            int dirty = memcmp(sl->original_page_va, sl->original_page_snapshot, seg->page_size);
-            fprintf(stderr, " %s%lx", dirty? "*":"", page_num);          
-        }                   
-        
-        if (page_table_elt->current_transaction == seg->transaction_id) {
-            // Only release pages owned by this transaction!
-            // Pages that were only read and not modified by this transaction will not be marked as
-            // associated with this transaction under optimistic locking. They may even be
-            // associated with another transaction.
-            
-            page_table_elt->current_transaction = 0;
-        }    
+    if (seg->arena_peak > seg->arena_high_water) {
+        madvise(seg->snapshot_arena + seg->arena_high_water * seg->page_size,
+                (seg->arena_peak - seg->arena_high_water) * seg->page_size, MADV_DONTNEED);
+        seg->arena_peak = seg->arena_high_water;
     }
+}
+
+static void free_snapshot_set(shared_segment *seg) {
+    size_t n_pages = seg->page_size ? seg->shared_seg_size/seg->page_size : 0;
     
-    if (stm_verbose & 4)
-        fprintf(stderr, " ]\n");
+    if (seg->snapshots)
+        munmap(seg->snapshots, n_pages * sizeof(snapshot_element));
+    seg->snapshots = NULL;
+    seg->n_snapshots = 0;
     
-    free_snapshot_list(seg);
-        
-    // reprotect *all* pages with the default inter-transaction protection.
+    if (seg->snapshot_index)
+        munmap(seg->snapshot_index, n_pages * sizeof(uint32_t));
+    seg->snapshot_index = NULL;
     
+    if (seg->snapshot_arena)
+        munmap(seg->snapshot_arena, seg->shared_seg_size);
+    seg->snapshot_arena = NULL;
     
-#ifdef PRIVATE_MAPPING_IS_PRIVATE 
-    if (seg->default_prot_flags == PROT_NONE) {
-        status = (void*)(long)mprotect(seg->shared_base_va, seg->shared_seg_size, PROT_NONE);
-    } else
-#endif // ifdef PRIVATE_MAPPING_IS_PRIVATE
-        
-    {
-        int mmap_flags;
-#ifdef PRIVATE_MAPPING_IS_PRIVATE
-        mmap_flags = MAP_FIXED|MAP_SHARED;
-#else
-        mmap_flags = MAP_FIXED|MAP_PRIVATE;
-#endif
-        status = mmap(seg->shared_base_va, seg->shared_seg_size, seg->default_prot_flags, mmap_flags, seg->fd, 
-                      (off_t)0);
-    }
-    if (status == (void*)-1)
-        perror("abort_transaction_on_segment: mmap error");
+    if (seg->line_masks)
+        munmap(seg->line_masks, n_pages * PAGEOPS_MASK_WORDS(seg->page_size) * sizeof(uint64_t));
+    seg->line_masks = NULL;
     
-    seg->transaction_id = 0;    
-            
-}
+    if (seg->preimage_arena)
+        munmap(seg->preimage_arena, seg->shared_seg_size);
+    seg->preimage_arena = NULL;
+    
+    if (seg->preimage_pages)
+        munmap(seg->preimage_pages, n_pages * sizeof(uint32_t));
+    seg->preimage_pages = NULL;
+    
+    if (seg->nesting_marks)
+        free(seg->nesting_marks);
+    seg->nesting_marks = NULL;
+}    
+
+static int compare_snapshot_elements(const void *a, const void *b) {
+    const snapshot_element *sa = a, *sb = b;
+    
+    return (sa->original_page_va < sb->original_page_va) ? -1 : (sa->original_page_va > sb->original_page_va);
+}
+
+// Put the snapshot set in ascending address order, and fix up the index to match.
+//
+static void sort_snapshot_set(shared_segment *seg) {
+    int i;
+    
+    if (seg->snapshots_sorted)
+        return;
+    
+    qsort(seg->snapshots, seg->n_snapshots, sizeof(snapshot_element), compare_snapshot_elements);
+    for (i = 0; i < seg->n_snapshots; i++)
+        seg->snapshot_index[(seg->snapshots[i].original_page_va - seg->shared_base_va)/seg->page_size] = i + 1;
+    seg->snapshots_sorted = 1;
+}
+
+
+// Take away access to n_pages pages starting at va, which are put back the way they are at the start of the
+// transaction.  If the pages may have private copies in them, they are thrown away by mapping the file over the
+// pages again; otherwise only the protection needs to change.
+//
+static int revoke_page_run(shared_segment *seg, void *va, size_t n_pages, int private_copies) {
+    void *status;
+    int mmap_flags;
+    
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD)
+        return madvise(va, n_pages * seg->page_size, MADV_DONTNEED);
+#endif
+    
+    if (!private_copies)
+        return mprotect(va, n_pages * seg->page_size, PROT_NONE);
+    
+#ifdef PRIVATE_MAPPING_IS_PRIVATE
+    mmap_flags = MAP_FIXED|MAP_SHARED;
+#else
+    mmap_flags = MAP_FIXED|MAP_PRIVATE;
+#endif
+    
+    status = mmap(va, n_pages * seg->page_size, PROT_NONE, mmap_flags, seg->fd, (off_t)(va - seg->shared_base_va));
+    return (status == (void*)-1) ? -1 : 0;
+}
+
+
+// Put the segment back the way it is between transactions.  Only the pages touched by the transaction are
+// affected, a run of adjacent pages at a time, so this costs the same however large the segment is.
+// Private copies of pages we wrote are thrown away, and pages we only read are just made inaccessible again,
+// unless they are to be kept as warm pages.
+//
+static int restore_segment_pages(shared_segment *seg, int keep_read_pages) {
+    snapshot_element *sl, *run, *end;
+    size_t n_pages;
+    
+    sort_snapshot_set(seg);
+    
+    for (sl = seg->snapshots, end = seg->snapshots + seg->n_snapshots; sl < end; ) {
+        run = sl;
+        n_pages = 0;
+        do {
+            n_pages++;
+            sl++;
+        } while (sl < end && sl->original_page_va == run->original_page_va + n_pages * seg->page_size &&
+                 sl->page_writable == run->page_writable);
+        
+        if (keep_read_pages && !run->page_writable)
+            continue;
+        
+        if (revoke_page_run(seg, run->original_page_va, n_pages, run->page_writable) != 0)
+            return -1;
+    }
+    
+    return 0;
+}
+
+
+// The pages made accessible between transactions, most likely by the program setting up its data, are kept track
+// of as a sorted array of ranges.  Neighbouring ranges are merged as pages are added, so that in the usual case of
+// sequential access there are only a few of them.
+
+// Returns the index of the first range that ends after va, or n_granted_ranges if there is none.
+//
+static int find_granted_range(shared_segment *seg, void *va) {
+    int lo = 0, hi = seg->n_granted_ranges, mid;
+    
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (seg->granted_ranges[mid].va + seg->granted_ranges[mid].len <= va)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int page_is_granted(shared_segment *seg, void *page_base) {
+    int i = find_granted_range(seg, page_base);
+    
+    return i < seg->n_granted_ranges && seg->granted_ranges[i].va <= page_base;
+}
+
+static int add_granted_page(shared_segment *seg, void *page_base, int *error) {
+    page_range *r;
+    int i = find_granted_range(seg, page_base);
+    int join_prev = (i > 0 && seg->granted_ranges[i-1].va + seg->granted_ranges[i-1].len == page_base);
+    int join_next = (i < seg->n_granted_ranges && seg->granted_ranges[i].va == page_base + seg->page_size);
+    
+    if (i < seg->n_granted_ranges && seg->granted_ranges[i].va <= page_base)
+        return 0;
+    
+    if (join_prev && join_next) {
+        seg->granted_ranges[i-1].len += seg->page_size + seg->granted_ranges[i].len;
+        memmove(&seg->granted_ranges[i], &seg->granted_ranges[i+1],
+                (seg->n_granted_ranges - i - 1) * sizeof(page_range));
+        seg->n_granted_ranges--;
+    } else if (join_prev) {
+        seg->granted_ranges[i-1].len += seg->page_size;
+    } else if (join_next) {
+        seg->granted_ranges[i].va = page_base;
+        seg->granted_ranges[i].len += seg->page_size;
+    } else {
+        if (seg->n_granted_ranges == seg->max_granted_ranges) {
+            if ((r = realloc(seg->granted_ranges, (seg->max_granted_ranges + 16) * sizeof(page_range))) == NULL) {
+                *error = STM_ALLOC_ERROR;
+                return -1;
+            }
+            seg->granted_ranges = r;
+            seg->max_granted_ranges += 16;
+        }
+        memmove(&seg->granted_ranges[i+1], &seg->granted_ranges[i],
+                (seg->n_granted_ranges - i) * sizeof(page_range));
+        seg->granted_ranges[i].va = page_base;
+        seg->granted_ranges[i].len = seg->page_size;
+        seg->n_granted_ranges++;
+    }
+    return 0;
+}
+
+// Take away access to everything made accessible since the last transaction.
+//
+static int revoke_granted_ranges(shared_segment *seg) {
+    int i, private_copies;
+    
+    // Writes between transactions go straight to the file, except with a private mapping.
+#ifdef PRIVATE_MAPPING_IS_PRIVATE
+    private_copies = 0;
+#else
+    private_copies = (seg->default_prot_flags & PROT_WRITE) != 0;
+#endif
+    
+    for (i = 0; i < seg->n_granted_ranges; i++) {
+        if (revoke_page_run(seg, seg->granted_ranges[i].va, seg->granted_ranges[i].len / seg->page_size,
+                            private_copies) != 0)
+            return -1;
+    }
+    seg->n_granted_ranges = 0;
+    return 0;
+}
+
+
+// Pages that were only read and not modified by this transaction are not locked by it under optimistic locking.
+// They may even be locked by another transaction.  So only pages this transaction owns are unlocked, and given
+// the new version if it changed them.  Nobody else changes the word of a page while it is locked.
+//
+static void unlock_page(shared_segment *seg, page_table_element *page_table_elt, int changed,
+                        transaction_id_t version) {
+    int64_t word = read_page_word(page_table_elt);
+    
+    if (page_owner(word) != seg->transaction_id ||
+        !atomic_compare_and_swap_64(word, page_word(0, changed ? version : page_version(word)),
+                                    &page_table_elt->page_word))
+        return;
+    if (*(volatile int32_t *)&seg->segment_transaction_data->page_waiters)
+        atomic_wake_all(page_owner_half(page_table_elt));
+    if (changed && *(volatile int32_t *)&seg->segment_transaction_data->retry_waiters)
+        atomic_wake_all(page_version_half(page_table_elt));
+}
+
+// A page locked by another transaction is most likely locked by one in the middle of committing, which will be
+// done with it in a few microseconds.  Rather than abort, wait a little while for it to be unlocked, which
+// wakes us if we are asleep.  Returns the page's word as of when it was unlocked, or when we gave up.  The
+// version may have changed meanwhile, which the caller has to check.  The userfaultfd thread doesn't wait at all:
+// all the other faults in the process would wait behind it, so the faulting transaction is aborted instead.
+//
+static int64_t wait_for_page_owner(shared_segment *seg, page_table_element *page_table_elt, int64_t word) {
+    struct timespec start, now;
+    long waited = 0;
+    int spins;
+    
+    if (in_uffd_handler)
+        return word;
+    
+    atomic_increment_32(&page_waits);
+    for (spins = 0; spins < STM_PAGE_WAIT_SPINS; spins++) {
+        atomic_pause();
+        if (page_owner(word = read_page_word(page_table_elt)) == 0)
+            goto unlocked;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (waited < STM_PAGE_WAIT_USEC) {
+        // If the page is unlocked before we are asleep, the futex sees that the owner has changed.
+        atomic_increment_32(&seg->segment_transaction_data->page_waiters);
+        atomic_wait_while_equal(page_owner_half(page_table_elt), page_owner(word), STM_PAGE_WAIT_USEC - waited);
+        atomic_decrement_32(&seg->segment_transaction_data->page_waiters);
+        if (page_owner(word = read_page_word(page_table_elt)) == 0)
+            goto unlocked;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+    }
+    return word;
+    
+unlocked:
+    atomic_increment_32(&page_waits_unlocked);
+    return word;
+}
+
+// Pages that keep causing aborts, like counters and the heads of queues, are locked as soon as they are written,
+// so that a transaction that would collide on one finds out before doing the work of a transaction that can't
+// commit, and the one that has it can't be aborted over it.  Pages that are rarely fought over stay optimistic,
+// and so does a page whose contention has died down.
+//
+// Only conflicts between writers count:  a reader aborted over a page somebody wrote would be no better off if
+// the writer had locked it early.  So a page that is read by many and written by few doesn't become contended.
+
+static int32_t page_contention(shared_segment *seg, page_table_element *page_table_elt) {
+    int32_t contention = *(volatile int32_t *)&page_table_elt->contention;
+    uint32_t decay;
+    
+    if (contention == 0)
+        return 0;
+    decay = (uint32_t)(*(volatile int32_t *)&seg->segment_transaction_data->commit_sequence -
+                       *(volatile int32_t *)&page_table_elt->contention_sequence) / STM_CONTENTION_DECAY;
+    return (decay < (uint32_t)contention) ? contention - (int32_t)decay : 0;
+}
+
+static void set_page_contention(shared_segment *seg, page_table_element *page_table_elt, int32_t contention) {
+    page_table_elt->contention_sequence = seg->segment_transaction_data->commit_sequence;
+    page_table_elt->contention = contention;
+}
+
+static void note_page_contention(shared_segment *seg, page_table_element *page_table_elt, int is_write) {
+    int32_t contention;
+    
+    if (!is_write || (contention = page_contention(seg, page_table_elt)) >= STM_CONTENTION_MAX)
+        return;
+    set_page_contention(seg, page_table_elt, (contention + STM_CONTENTION_STEP < STM_CONTENTION_MAX) ?
+                                             contention + STM_CONTENTION_STEP : STM_CONTENTION_MAX);
+}
+
+static void note_page_committed(shared_segment *seg, page_table_element *page_table_elt) {
+    int32_t contention;
+    
+    if (*(volatile int32_t *)&page_table_elt->contention != 0)
+        set_page_contention(seg, page_table_elt, (contention = page_contention(seg, page_table_elt)) > 0 ?
+                                                 contention - 1 : 0);
+}
+
+// A page that is contended enough may be locked early, by a transaction that holds the lock until it commits,
+// however long that is, so there is no point in a reader waiting for it.
+//
+static int page_may_be_locked_early(shared_segment *seg, page_table_element *page_table_elt) {
+    return stm_eager_threshold != 0 && !seg->merge_mode && page_contention(seg, page_table_elt) >= stm_eager_threshold;
+}
+
+// With visible readers, a transaction marks each page it reads before it checks the page's version for the last
+// time, and a commit dooms the transactions that have marked a page after locking it and before changing it.
+// So a transaction that has not been doomed knows that nothing it has read has changed, and one that reads a
+// page after the commit has dealt with the marks finds the page locked or with its new version.
+//
+static void mark_page_read(shared_segment *seg, size_t page_num) {
+    int64_t bit;
+    
+    if (!seg->visible_readers || seg->registry_slot < 0)
+        return;
+    bit = reader_bit(seg->registry_slot);
+    if (!(*(volatile int64_t *)&seg->page_readers[page_num] & bit))
+        atomic_or_64(bit, &seg->page_readers[page_num]);
+}
+
+// Each bit stands for every slot with that number modulo 64, and may have been left by a transaction that has
+// finished, so some of the transactions doomed here did not read the page.  They only have to check their
+// read sets to find that out.
+//
+static void doom_page_readers(shared_segment *seg, size_t page_num) {
+    int64_t readers;
+    uint64_t claimed;
+    int w, bit, slot;
+    
+    if (!seg->visible_readers || *(volatile int64_t *)&seg->page_readers[page_num] == 0)
+        return;
+    
+    readers = atomic_swap_64(0, &seg->page_readers[page_num]);
+    for (; readers; readers &= readers - 1) {
+        bit = __builtin_ctzll(readers);
+        for (w = 0; w < registry_words(seg->registry_slots); w++) {
+            claimed = seg->registry_claimed[w];
+            slot = w * 64 + bit;
+            if ((claimed >> bit) & 1 && slot != seg->registry_slot) {
+                atomic_swap_32(1, &seg->registry_doomed[slot]);
+                atomic_increment_32(&doomed_transactions);
+            }
+        }
+    }
+}
+
+
+static void abort_transaction_on_segment(shared_segment *seg) {
+    snapshot_element *sl;
+    size_t page_num;
+    page_table_element *page_table_elt;
+    
+    if (seg->transaction_id == 0) {
+        if (stm_verbose & 2)
+            fprintf(stderr, "Aborting transaction but transaction_id is already 0\n");
+        return;
+    }
+    
+    if (stm_verbose & 4)
+        fprintf(stderr, "Aborting Transaction %d [", seg->transaction_id);
+    
+    delete_active_transaction(seg);
+    
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+
+        page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;         
+        page_table_elt = &(seg->segment_page_table[page_num]);
+        
+        if (stm_verbose & 4) {
+            int dirty = sl->page_writable &&
+                        page_differs(sl->original_page_va, sl->original_page_snapshot, seg->page_size);
+            fprintf(stderr, " %s%lx", dirty? "*":"", page_num);          
+        }                   
+        
+        unlock_page(seg, page_table_elt, 0, 0);
+    }
+    
+    if (stm_verbose & 4)
+        fprintf(stderr, " ]\n");
+    
+    // discard our changes, and reprotect the pages with the default inter-transaction protection.
+    
+    if (restore_segment_pages(seg, 0) != 0)
+        perror("abort_transaction_on_segment: mmap error");
+    
+    clear_snapshot_set(seg);
+    
+    seg->transaction_id = 0;    
+            
+}
 
 
 
@@ -617,11 +1649,16 @@ int _stm_transaction_stack_empty() {
     return (transaction_stack() == NULL);
 }
 
+static int start_nested_transaction();
+
 static int push_transaction_stack(char *trans_name) {
     transaction_stack_element *trans;
     
     
-    if ((trans = calloc(1, sizeof(transaction_stack_element))) == NULL) {
+    if (transaction_stack() != NULL && pending_transaction != NULL) {
+        trans = pending_transaction;
+        pending_transaction = NULL;
+    } else if ((trans = calloc(1, sizeof(transaction_stack_element))) == NULL) {
         set_stm_errno(STM_ALLOC_ERROR);
         return -1;
     }
@@ -638,9 +1675,13 @@ static int push_transaction_stack(char *trans_name) {
 #endif
     
     trans->transaction_name = trans_name;
+    trans->abandoned = 0;
     trans->next = transaction_stack();
     set_transaction_stack(trans);
     
+    if (trans->retryable && trans->next != NULL && start_nested_transaction() != 0)
+        return -1;
+    
 #if 0
     printf("> ");
     for (trans = transaction_stack(); trans; trans = trans->next)
@@ -670,79 +1711,99 @@ static void pop_transaction_stack() {
     }
 }
 
-static void stm_abort_transaction() {
+static void leave_commit_gate();
+static void release_irrevocable_token(shared_segment *seg);
+static int admit_transaction(shared_segment *seg);
+static void release_admission(shared_segment *seg, int outcome);
+static void retry_nested_transaction();
+
+// conflict is 0 if the transaction is giving up by itself, in stm_retry(), which says nothing about contention.
+//
+static void stm_abort_transaction(int conflict) {
     shared_segment *seg;
     
+    leave_commit_gate();
     for(seg = shared_segment_list(); seg; seg = seg->next) {
-        abort_transaction_on_segment(seg);
+        if (conflict)
+            contention.karma += seg->n_snapshots;
+        release_admission(seg, (seg->transaction_id && conflict) ? 0 : -1);
+        if (seg->transaction_id)
+            abort_transaction_on_segment(seg);
+        seg->in_transaction = 0;
+        seg->n_nesting_marks = 0;
+        release_irrevocable_token(seg);
     }
     while (transaction_stack())
         pop_transaction_stack();
+    if (pending_transaction) {
+        free(pending_transaction);
+        pending_transaction = NULL;
+    }
     
 }
 
+// A conflict that the innermost nested transaction can be retried for doesn't come back from here.
+//
 static void transaction_error_exit(int error_code, int return_value) {
     if (error_code)
         set_stm_errno(error_code);
-    stm_abort_transaction();
-    longjmp(*stm_jmp_buf(), return_value);
+    if (return_value > 0)
+        retry_nested_transaction();
+    stm_abort_transaction(1);
+    siglongjmp(*stm_jmp_buf(), return_value);
     
 }
 
 
 
-static int insert_into_snapshot_list(shared_segment *seg, void *va, transaction_id_t trans_id) {
+// Record a page's first access in a transaction.
+// This may run in the userfaultfd handler thread rather than the thread doing the transaction, so errors
+// are passed back through *error rather than stm_errno.
+//
+static snapshot_element *insert_into_snapshot_set(shared_segment *seg, void *va, transaction_id_t trans_id,
+                                                  int *error) {
     
-    snapshot_list_element *new_elt, *sl, *prev;
+    snapshot_element *new_elt;
+    size_t page_num;
     
-    //  fprintf(stderr, "inserting into snapshot list %x\n", va);
+    //  fprintf(stderr, "inserting into snapshot set %x\n", va);
     
     if (va < seg->shared_base_va || seg->shared_base_va + seg->shared_seg_size <= va) {
         if (stm_verbose & 1)
-            fprintf(stderr, "insert_into_snapshot_list: va %lx not in segment\n", (unsigned long)va);
-        set_stm_errno(STM_ACCESS_ERROR);
-        return -1;
+            fprintf(stderr, "insert_into_snapshot_set: va %lx not in segment\n", (unsigned long)va);
+        *error = STM_ACCESS_ERROR;
+        return NULL;
     }
     
-    if ((new_elt = seg->snapshot_pool) != NULL) {
-        seg->snapshot_pool = new_elt->next;
-        new_elt->next = NULL;
-        
-    } else {
-        if ((new_elt = calloc(1, sizeof(snapshot_list_element))) == NULL) {
-            set_stm_errno(STM_ALLOC_ERROR);
-            return -1;
-        }
-        
-        if ((new_elt->original_page_snapshot = malloc(seg->page_size)) == NULL) {
-            set_stm_errno(STM_ALLOC_ERROR);
-            return -1;
-        }        
+    page_num = (va - seg->shared_base_va)/seg->page_size;
+    if (seg->snapshot_index[page_num] != 0) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "insert_into_snapshot_set: duplicate page at %lx\n", (unsigned long)va);
+        return &seg->snapshots[seg->snapshot_index[page_num] - 1];
     }
     
+    // There is room for every page in the segment, so nothing needs to be allocated here.  The snapshot buffer
+    // comes from the snapshot arena on the first write to the page.
+    
+    new_elt = &seg->snapshots[seg->n_snapshots];
+    if (seg->n_snapshots > 0 && va < new_elt[-1].original_page_va)
+        seg->snapshots_sorted = 0;
+    
     new_elt->original_page_va = va;        
+    new_elt->page_writable = 0;
     new_elt->page_dirty = 0;    
     new_elt->snapshot_transaction_id = trans_id;
     
-    memcpy(new_elt->original_page_snapshot, va, seg->page_size);
-    
-    for(sl = seg->snapshot_list, prev=NULL; sl; prev = sl, sl = sl->next) {
-        if (va < sl->original_page_va) {
-            break;
-        } else if (va == sl->original_page_va) {
-            if (stm_verbose & 1)
-                fprintf(stderr, "insert_into_snapshot_list: duplicate page at %lx\n", (unsigned long)va);
-        }
-    }
+    seg->snapshot_index[page_num] = ++seg->n_snapshots;
     
-    new_elt->next = sl;     // either item to insert before, or NULL if no list or we ran off end
-    if (prev)
-        prev->next = new_elt;
-    else
-        seg->snapshot_list = new_elt;
+    return new_elt;
     
-    return 0;
+}
+
+static snapshot_element *find_in_snapshot_set(shared_segment *seg, void *va) {
+    uint32_t i = seg->snapshot_index[(va - seg->shared_base_va)/seg->page_size];
     
+    return i ? &seg->snapshots[i - 1] : NULL;
 }
 
 
@@ -780,261 +1841,1848 @@ size_t stm_page_size(shared_segment *seg) {
     return seg->page_size;
 }
 
+int stm_set_snapshot_arena(shared_segment *seg, size_t high_water, int flags) {
+    
+    seg->arena_high_water = (high_water + seg->page_size - 1) / seg->page_size;
+    
+    if (seg->arena_peak > seg->arena_high_water && seg->arena_used == 0) {
+        madvise(seg->snapshot_arena + seg->arena_high_water * seg->page_size,
+                (seg->arena_peak - seg->arena_high_water) * seg->page_size, MADV_DONTNEED);
+        seg->arena_peak = seg->arena_high_water;
+    }
+    
+    if (flags & STM_SNAPSHOT_HUGEPAGES) {
+#ifdef MADV_HUGEPAGE
+        if (madvise(seg->snapshot_arena, seg->shared_seg_size, MADV_HUGEPAGE) != 0) {
+            if (stm_verbose & 1)
+                perror("stm_set_snapshot_arena: madvise error");
+            set_stm_errno(STM_MMAP_ERROR);
+            return -1;
+        }
+#else
+        set_stm_errno(STM_MMAP_ERROR);
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+int stm_set_merge_mode(shared_segment *seg, int enable) {
+    seg->merge_mode = enable;
+    return 0;
+}
+
 int stm_segment_fd(shared_segment *seg) {
     return seg->fd;
 }
 
 
-// signal_handler is invoked when there is a read or write access to a shared segment during a transaction.
-// It remaps the page accessed to be private, with read and write access allowed.  But it also makes a snapshot
-// of the page before it is allowed to be modified.  This allows the commit mechanism to detect dirty pages
-// that need to be written.
-
-static void signal_handler(int sig, siginfo_t *si, void *foo) {
-    void *page_base;    
-    void *status;
-    shared_segment *seg;
-    page_table_element *page_table_elt;
-    transaction_id_t completed_transaction;
-    size_t page_num;   
+// Unlikely we'll wrap, but if we do, skip 0 and the placeholders.
+//
+static transaction_id_t new_transaction_id(shared_segment *seg) {
+    transaction_id_t id;
     
-    struct sigaction sa;
+    do {
+        id = atomic_increment_32((int32_t*)&seg->segment_transaction_data->transaction_counter);
+    } while (id == 0 || id == PENDING_TRANSACTION_ID || id == UNLOCKING_TRANSACTION_ID);
+    return id;
+}
+
+// A segment joins the thread's transaction the first time it is touched in it, so that segments a transaction
+// doesn't use cost it nothing.  This may run in the userfaultfd handler thread, so it doesn't set stm_errno.
+//
+// returns:
+//  0 - success
+//  1 - the registry is full, or this is the userfaultfd thread and a slot is still being filled in:  should retry
+// and on failure, *error holds the error code for stm_errno.
+//
+static int enroll_segment(shared_segment *seg, int *error) {
     
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_handler = SIG_DFL;
+    // With the version clock, all a transaction needs to know is the time it started.
     
-    if (transaction_stack() == NULL) {
-        if (stm_verbose & 1)
-            fprintf(stderr, "signal_handler: virtual address %lx referenced outside transaction\n",
-                    (unsigned long)si->si_addr);
-        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
-        transaction_error_exit(STM_ACCESS_ERROR, -1);       
-        return;
+    if (seg->validation == STM_VALIDATE_VERSION_CLOCK) {
+        seg->transaction_id = UNLOCKING_TRANSACTION_ID;
+        seg->validated_sequence = seg->segment_transaction_data->commit_sequence;
+        return 0;
     }
     
-    seg = stm_find_shared_segment(si->si_addr);
-        
-    if (seg == NULL) {
-        if (stm_verbose & 1)
-            fprintf(stderr, "signal_handler: virtual address %lx not found in shared segment\n",
-                    (unsigned long)si->si_addr);
-        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
-        transaction_error_exit(STM_ACCESS_ERROR, -1);               
-        return;
+    if (add_active_transaction(seg) != 0) {
+        *error = STM_REGISTRY_FULL_ERROR;
+        return 1;
     }
     
-    if (seg->transaction_id == 0) {
-        if (stm_verbose & 1)
-            fprintf(stderr, "signal_handler:  signal received outside transaction\n");
-        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
-        transaction_error_exit(STM_ACCESS_ERROR, -1);               
+    // Our slot says we are on the way, so from here on anybody who gets a later transaction ID will wait to see
+    // ours.
+    
+    seg->transaction_id = new_transaction_id(seg);
+    if (!atomic_compare_and_swap_64(seg->registry_claim, seg->transaction_id,
+                                    &seg->registry_ids[seg->registry_slot])) {
+        // We took so long that our slot was taken back, and it may have been claimed again since.
+        seg->registry_slot = -1;
+        seg->transaction_id = 0;
+        *error = STM_COLLISION_ERROR;
+        return 1;
     }
     
-    page_base = (void*)((long)si->si_addr & ~(seg->page_size-1));       
-    page_num = (page_base - seg->shared_base_va)/seg->page_size;
-    page_table_elt = &(seg->segment_page_table[page_num]);
-    completed_transaction = page_table_elt->completed_transaction;
+    // The userfaultfd thread can't wait for the slots still being filled in, so the faulting transaction is aborted
+    // instead, and tries again.
     
-#define OPTIMISTIC_LOCKING
+    if (snapshot_active_transactions(seg) != 0) {
+        delete_active_transaction(seg);
+        seg->transaction_id = 0;
+        *error = STM_COLLISION_ERROR;
+        return 1;
+    }
+    seg->validated_sequence = seg->segment_transaction_data->commit_sequence;
+    return 0;
+}
+
+
+// Pages we have only read are not copied, so they can change underneath us.  Whenever anybody has committed
+// changes to the segment since we last looked, make sure none of them were to pages we have read, so that we
+// don't carry on computing with inconsistent data any longer than we have to.  In merge mode, changes to pages we
+// have written are left to be sorted out at commit.
+//
+// returns:
+//  0 - pages read so far are still consistent
+//  1 - collision:  should retry aborted transaction
+//
+static int validate_read_set(shared_segment *seg) {
+    snapshot_element *sl;
+    page_table_element *page_table_elt;
+    size_t page_num;
+    int64_t word;
+    int32_t sequence = seg->segment_transaction_data->commit_sequence;
     
-#ifdef OPTIMISTIC_LOCKING
+    if (sequence == seg->validated_sequence)
+        return 0;
     
-    if (page_table_elt->current_transaction != 0) {
-        if (seg->transaction_id != page_table_elt->current_transaction) {
-            
-            if (stm_verbose & 2)
-                fprintf(stderr, "Transaction %d owns page %lx while transaction %d is snapshotting it.\n",
-                        page_table_elt->current_transaction, page_num, seg->transaction_id);
-            collision_histo[0]++;
-            transaction_error_exit(STM_COLLISION_ERROR, 1);
-            return;
-        } else {
-            if (stm_verbose & 1)
-                fprintf(stderr, "Transaction %d already owns page %lx\n", 
-                        page_table_elt->current_transaction, page_num);
-            transaction_error_exit(STM_OWNERSHIP_ERROR, -1);
+    // A transaction with visible readers is told if it has to look.  The flag is cleared before looking, so
+    // that a commit that dooms us while we look is not forgotten.
+    
+    if (seg->visible_readers && seg->registry_slot >= 0) {
+        if (*(volatile int32_t *)&seg->registry_doomed[seg->registry_slot] == 0) {
+            atomic_increment_32(&unchecked_validations);
+            seg->validated_sequence = sequence;
+            return 0;
         }
+        atomic_swap_32(0, &seg->registry_doomed[seg->registry_slot]);
     }
     
-#else
-    
-    if (atomic_compare_and_swap_32(0, seg->transaction_id,
-                                   (int32_t*)&(page_table_elt->current_transaction))) {
-        //              fprintf(stderr, "succeeded in locking page %x\n", page_num);
-    } else {    
-        if (stm_verbose & 2)
-            fprintf(stderr,"Transaction %d owns page %x while transaction %d is snapshotting it.\n",
-                    page_table_elt->current_transaction, page_num, seg->transaction_id);
-        transaction_error_exit(STM_COLLISION_ERROR, 1); 
-        return;
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+        page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;
+        page_table_elt = &(seg->segment_page_table[page_num]);
+        
+        if (seg->merge_mode && sl->page_writable)
+            continue;
+        
+        word = read_page_word(page_table_elt);
+        if (sl->snapshot_transaction_id != page_version(word) ||
+            (page_owner(word) != 0 && page_owner(word) != seg->transaction_id)) {
+            if (stm_verbose & 2)
+                fprintf(stderr, "Page %lx read by transaction %d has been modified by transaction %d\n",
+                        page_num, seg->transaction_id, page_version(word));
+            note_page_contention(seg, page_table_elt, sl->page_writable);
+            return 1;
+        }
     }
     
+    seg->validated_sequence = sequence;
+    return 0;
+}
+
+// A fault outside any shared segment in the middle of a transaction may just mean that we have been reading
+// pages somebody else was changing, and followed a pointer that was never valid.  If so, we retry rather than die.
+//
+static int stale_transaction() {
+    shared_segment *seg;
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->transaction_id != 0 && validate_read_set(seg) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+// The second fault on a page tells us it is being written, but where the platform tells us the kind of access
+// up front we can save ourselves the second trip through the signal handler.
+//
+// Returns -1 if we can't tell.
+//
+static int fault_is_write(void *context) {
+#if defined(__linux__) && defined(__x86_64__)
+    return (((ucontext_t *)context)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#else
+    return -1;
 #endif
+}
+
+
+// The engine-specific part of the fault handling.  These make a page readable, or writable, in whatever way the
+// segment's fault engine requires, and return 0, or -1 with *error set.
+
+static int grant_read_access(shared_segment *seg, void *page_base, int *error) {
     
-    if ((int32_t)completed_transaction - (int32_t)seg->transaction_id > 0) {
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD) {
+        // Copy the page in from the shared view, write-protected so that a write comes back to us.
+        // The faulting thread is woken by the caller once we are all done with the page.
+        struct uffdio_copy copy;
         
-        if (stm_verbose & 2)
-            fprintf(stderr, "On page %lx, current transaction %d is before page's completed transaction %d\n",
-                    page_num, seg->transaction_id, completed_transaction);
-        
-        collision_histo[1]++;
-        transaction_error_exit(STM_COLLISION_ERROR, 1); 
-        return;
+        copy.dst = (unsigned long)page_base;
+        copy.src = (unsigned long)(seg->shared_view_va + (page_base - seg->shared_base_va));
+        copy.len = seg->page_size;
+        copy.mode = UFFDIO_COPY_MODE_WP|UFFDIO_COPY_MODE_DONTWAKE;
+        copy.copy = 0;
+        if (ioctl(uffd, UFFDIO_COPY, &copy) == -1) {
+            if (stm_verbose & 1)
+                perror("grant_read_access: UFFDIO_COPY error");
+            *error = STM_MMAP_ERROR;
+            return -1;
+        }
+        return 0;
     }
+#endif
     
-    if (find_prior_active_transaction(seg, completed_transaction)) {
-        if (stm_verbose & 2)
-            fprintf(stderr, "On page %lx, completed transaction %d was active when transaction %d started\n",
-                    page_num, completed_transaction, seg->transaction_id);
-        collision_histo[2]++;
-        transaction_error_exit(STM_COLLISION_ERROR, 1); 
-        return;
+    // Make the page readable only.  Under either mapping regime, reads now see the current contents of the
+    // file, which is fine as long as nobody modifies it before we commit.
+    
+    if (mprotect(page_base, seg->page_size, PROT_READ) == -1) {
+        if (stm_verbose & 1)
+            perror("signal_handler: mprotect error in sig handler");
+        *error = STM_MMAP_ERROR;
+        return -1;
     }
+    return 0;
+}
+
+static int grant_write_access(shared_segment *seg, void *page_base, int *error) {
+    void *status;
     
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD) {
+        // The page is already our own copy, so all we have to do is let writes through.
+        struct uffdio_writeprotect wp;
         
-          
+        wp.range.start = (unsigned long)page_base;
+        wp.range.len = seg->page_size;
+        wp.mode = UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+        if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) == -1) {
+            if (stm_verbose & 1)
+                perror("grant_write_access: UFFDIO_WRITEPROTECT error");
+            *error = STM_MMAP_ERROR;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    
 #ifdef PRIVATE_MAPPING_IS_PRIVATE
     // Change from shared to private mapping, and make the page readable and writable.
     //
- 
     status = mmap(page_base, seg->page_size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE, seg->fd,
                   (off_t)(page_base - seg->shared_base_va));
     
     if (status == (void*)-1) {
         if (stm_verbose & 1)
             perror("signal_handler: mmap error in sig handler");
-        transaction_error_exit(STM_MMAP_ERROR, -1);
-        return;
-        
+        *error = STM_MMAP_ERROR;
+        return -1;
     }
     
 #else
     // Private mapping is NOT private, so we have the whole segment mapped private.
     // By writing into a page we get a private copy of it which is all we need.
     
-    status = (void*)(long)mprotect(page_base, seg->page_size, PROT_READ|PROT_WRITE);
-    if (status == (void*)-1) {
-        if (stm_verbose & 1)
-            perror("signal_handler: mprotect error in sig handler");
-        transaction_error_exit(STM_MMAP_ERROR, -1);
+    status = (void*)(long)mprotect(page_base, seg->page_size, PROT_READ|PROT_WRITE);
+    if (status == (void*)-1) {
+        if (stm_verbose & 1)
+            perror("signal_handler: mprotect error in sig handler");
+        *error = STM_MMAP_ERROR;
+        return -1;
+    }
+    
+    // Some systems evidently allow changes by other processes to be reflected in private mappings.
+    // To prevent that (hopefully!) we modify the page (without really changing anything) to 
+    // invoke the "copy-on-write" semantics and really make a private copy
+    //
+    *(volatile int*)page_base = defeat_optimizer((volatile int*)page_base);
+#endif
+    return 0;
+}
+
+
+// Make a run of pages that are our own copies read-only, or writable again.  Returns 0, or -1 with *error set.
+//
+static int set_page_run_writable(shared_segment *seg, void *va, size_t n_pages, int writable, int *error) {
+    
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD) {
+        struct uffdio_writeprotect wp;
+        
+        wp.range.start = (unsigned long)va;
+        wp.range.len = n_pages * seg->page_size;
+        wp.mode = writable ? UFFDIO_WRITEPROTECT_MODE_DONTWAKE : UFFDIO_WRITEPROTECT_MODE_WP;
+        if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) == -1) {
+            if (stm_verbose & 1)
+                perror("set_page_run_writable: UFFDIO_WRITEPROTECT error");
+            *error = STM_MMAP_ERROR;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    
+    if (mprotect(va, n_pages * seg->page_size, writable ? PROT_READ|PROT_WRITE : PROT_READ) == -1) {
+        if (stm_verbose & 1)
+            perror("set_page_run_writable: mprotect error");
+        *error = STM_MMAP_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+// The first write in a nested transaction to a page written before it started.  Keep a copy of the page as it
+// was, so that the nested transaction can be undone by itself, and let the write through.
+//
+static int save_preimage(shared_segment *seg, snapshot_element *sl, int *error) {
+    size_t page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;
+    
+    if (seg->n_nesting_marks > 0) {
+        if ((size_t)seg->n_preimages < seg->shared_seg_size/seg->page_size) {
+            page_copy(seg->preimage_arena + seg->n_preimages * seg->page_size, sl->original_page_va, seg->page_size);
+            seg->preimage_pages[seg->n_preimages++] = page_num;
+        } else {
+            seg->preimages_overflowed = 1;
+        }
+    }
+    
+    sl->nest_protected = 0;
+    return set_page_run_writable(seg, sl->original_page_va, 1, 1, error);
+}
+
+
+// Lock a page we have just written, if it is contended, and nobody else holds the irrevocable token, who would
+// have no way to wait for us.  In merge mode, transactions writing the same page needn't collide at all, so
+// pages are never locked early.  word is the page's word, as last read, which must not be locked.  Returns 0, or 1
+// if the word has changed, in which case the caller should abort.
+//
+static int lock_page_eagerly(shared_segment *seg, page_table_element *page_table_elt, int64_t word) {
+    if (stm_eager_threshold == 0 || seg->merge_mode ||
+        page_contention(seg, page_table_elt) < stm_eager_threshold ||
+        (atomic_read_64(&seg->segment_transaction_data->irrevocable_holder) != 0 && !seg->irrevocable))
+        return 0;
+    
+    if (seg->transaction_id == UNLOCKING_TRANSACTION_ID)
+        seg->transaction_id = new_transaction_id(seg);
+    
+    if (!atomic_compare_and_swap_64(word, page_word(seg->transaction_id, page_version(word)),
+                                    &page_table_elt->page_word))
+        return 1;
+    atomic_increment_32(&eager_locks);
+    return 0;
+}
+
+void stm_set_eager_threshold(int threshold) {
+    stm_eager_threshold = threshold;
+}
+
+
+// Called on a write to a page that this transaction has already read.  Gives us a private, writable copy of the
+// page and takes a snapshot of it before it is modified.  This allows the commit mechanism to detect dirty pages
+// that need to be written.
+//
+// returns:
+//  0 - success
+// -1 - non-recoverable error
+//  1 - collision:  should retry aborted transaction
+//
+static int upgrade_snapshot_page(shared_segment *seg, snapshot_element *sl, page_table_element *page_table_elt,
+                                 size_t page_num, int *error) {
+    void *page_base = sl->original_page_va;
+    int64_t word;
+    
+    if (sl->page_writable && sl->nest_protected)
+        return save_preimage(seg, sl, error);
+    
+    if (sl->page_writable) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "signal_handler: write fault on page %lx which is already writable\n", page_num);
+        *error = STM_ACCESS_ERROR;
+        return -1;
+    }
+    
+    // Admission control only counts transactions that write, and lets them in as they first do.
+    
+    if (!seg->admitted && admit_transaction(seg) != 0) {
+        *error = STM_BUSY_ERROR;
+        return 1;
+    }
+    
+    sl->original_page_snapshot = seg->snapshot_arena + seg->arena_used * seg->page_size;
+    sl->changed_lines = seg->line_masks + seg->arena_used * PAGEOPS_MASK_WORDS(seg->page_size);
+    seg->arena_used++;
+    
+    if (grant_write_access(seg, page_base, error) != 0)
+        return -1;
+    
+    page_copy(sl->original_page_snapshot, page_base, seg->page_size);
+    sl->page_writable = 1;
+    
+    // Until now we were looking at the shared page, so make sure nobody changed it since we first read it,
+    // and nobody is in the middle of changing it.  With the irrevocable token, a page can only be locked by a
+    // transaction that locked it early, and can't commit until we are done, so it is no reason to wait.
+    
+    word = read_page_word(page_table_elt);
+    if (page_owner(word) != 0 && page_owner(word) != seg->transaction_id && !seg->irrevocable)
+        word = wait_for_page_owner(seg, page_table_elt, word);
+    
+    if (page_owner(word) != 0 && page_owner(word) != seg->transaction_id && !seg->irrevocable) {
+        if (stm_verbose & 2)
+            fprintf(stderr, "Transaction %d owns page %lx while transaction %d is snapshotting it. [3]\n",
+                    page_owner(word), page_num, seg->transaction_id);
+        collision_histo[3]++;
+        note_page_contention(seg, page_table_elt, 1);
+        *error = STM_BUSY_ERROR;
+        return 1;
+    }
+    
+    if (sl->snapshot_transaction_id != page_version(word) ||
+        (page_owner(word) == 0 && lock_page_eagerly(seg, page_table_elt, word) != 0)) {
+        if (stm_verbose & 2) {
+            fprintf(stderr, "Transaction %d modified page %lx after transaction %d read it\n", 
+                    page_version(word), page_num, seg->transaction_id);
+        }
+        collision_histo[4]++;
+        note_page_contention(seg, page_table_elt, 1);
+        *error = STM_COLLISION_ERROR;
+        return 1;
+    }
+    
+    return 0;
+}
+
+
+// page_fault handles a read or write access to a shared segment during a transaction, for either fault engine.
+// On the first access to a page it only grants read access, and records the version of the page so that the
+// commit mechanism can tell whether anybody else changed it.  A write, which may fault a second time, is handed
+// off to upgrade_snapshot_page().
+//
+// returns:
+//  0 - success
+// -1 - non-recoverable error
+//  1 - collision:  should retry aborted transaction
+// and on failure, *error holds the error code for stm_errno.
+//
+static int page_fault(shared_segment *seg, void *va, int is_write, int *error) {
+    void *page_base;    
+    page_table_element *page_table_elt;
+    snapshot_element *sl;
+    transaction_id_t completed_transaction;
+    int64_t word, latest;
+    size_t page_num;   
+    int status;
+    
+    if (validate_read_set(seg) != 0) {
+        collision_histo[9]++;
+        *error = STM_COLLISION_ERROR;
+        return 1;
+    }
+    
+    page_base = (void*)((long)va & ~(seg->page_size-1));       
+    page_num = (page_base - seg->shared_base_va)/seg->page_size;
+    page_table_elt = &(seg->segment_page_table[page_num]);
+    
+    if ((sl = find_in_snapshot_set(seg, page_base)) != NULL) {
+        if (seg->engine == STM_ENGINE_USERFAULTFD && !is_write)
+            return 0;   // a fault we already resolved, reported again
+        
+        // We can already read this page, so this must be a write.
+        return upgrade_snapshot_page(seg, sl, page_table_elt, page_num, error);
+    }
+    
+    word = read_page_word(page_table_elt);
+    
+    // A reader doesn't wait for a page that may have been locked early, which could take as long as the whole
+    // transaction that locked it.
+    
+    if (page_owner(word) != 0 && page_owner(word) != seg->transaction_id && !seg->irrevocable &&
+        (is_write || !page_may_be_locked_early(seg, page_table_elt))) {
+        word = wait_for_page_owner(seg, page_table_elt, word);
+        
+        // If the commit we waited for changed pages we have read, we may as well find out now.  If not, the
+        // transaction can go on as of the new commit_sequence, which with the version clock is what lets it
+        // read what was just committed.
+        
+        if (page_owner(word) == 0 && validate_read_set(seg) != 0) {
+            collision_histo[9]++;
+            *error = STM_COLLISION_ERROR;
+            return 1;
+        }
+    }
+    completed_transaction = page_version(word);
+    
+#define OPTIMISTIC_LOCKING
+    
+#ifdef OPTIMISTIC_LOCKING
+    
+    // With the irrevocable token, the page can only be locked early by a transaction that hasn't changed it yet.
+    
+    if (page_owner(word) != 0 && !seg->irrevocable) {
+        if (seg->transaction_id != page_owner(word)) {
+            
+            if (stm_verbose & 2)
+                fprintf(stderr, "Transaction %d owns page %lx while transaction %d is snapshotting it.\n",
+                        page_owner(word), page_num, seg->transaction_id);
+            collision_histo[0]++;
+            note_page_contention(seg, page_table_elt, is_write);
+            *error = STM_BUSY_ERROR;
+            return 1;
+        } else {
+            if (stm_verbose & 1)
+                fprintf(stderr, "Transaction %d already owns page %lx\n", 
+                        page_owner(word), page_num);
+            *error = STM_OWNERSHIP_ERROR;
+            return -1;
+        }
+    }
+    
+#else
+    
+    if (page_owner(word) == 0 &&
+        atomic_compare_and_swap_64(word, page_word(seg->transaction_id, completed_transaction),
+                                   &page_table_elt->page_word)) {
+        word = page_word(seg->transaction_id, completed_transaction);
+    } else {    
+        if (stm_verbose & 2)
+            fprintf(stderr,"Transaction %d owns page %lx while transaction %d is snapshotting it.\n",
+                    page_owner(word), page_num, seg->transaction_id);
+        *error = STM_COLLISION_ERROR;
+        return 1;
+    }
+    
+#endif
+    
+    if (seg->irrevocable) {
+        
+        // Nobody else can commit changes, so whatever is here is consistent with everything else we have read.
+        
+    } else if (seg->validation == STM_VALIDATE_VERSION_CLOCK) {
+        
+        // The page must not have changed since the time as of which everything we have read so far is known
+        // to be consistent.
+        
+        if ((int32_t)(completed_transaction - seg->validated_sequence) > 0) {
+            if (stm_verbose & 2)
+                fprintf(stderr, "On page %lx, version %d is later than transaction's read version %d\n",
+                        page_num, completed_transaction, seg->validated_sequence);
+            collision_histo[1]++;
+            *error = STM_COLLISION_ERROR;
+            return 1;
+        }
+        
+    } else if ((int32_t)completed_transaction - (int32_t)seg->transaction_id > 0) {
+        
+        if (stm_verbose & 2)
+            fprintf(stderr, "On page %lx, current transaction %d is before page's completed transaction %d\n",
+                    page_num, seg->transaction_id, completed_transaction);
+        
+        collision_histo[1]++;
+        *error = STM_COLLISION_ERROR;
+        return 1;
+        
+    } else if (find_prior_active_transaction(seg, completed_transaction)) {
+        if (stm_verbose & 2)
+            fprintf(stderr, "On page %lx, completed transaction %d was active when transaction %d started\n",
+                    page_num, completed_transaction, seg->transaction_id);
+        collision_histo[2]++;
+        *error = STM_COLLISION_ERROR;
+        return 1;
+    }
+    
+    if (grant_read_access(seg, page_base, error) != 0)
+        return -1;
+    
+    if ((sl = insert_into_snapshot_set(seg, page_base, completed_transaction, error)) == NULL)
+        return -1;
+    
+    mark_page_read(seg, page_num);
+    
+    // Double check to make sure that during the above, nobody grabbed or changed this page.  Since the owner
+    // and the version are read together, the word being the same as before is enough.
+    
+    if ((latest = read_page_word(page_table_elt)) != word &&
+        !(seg->irrevocable && page_version(latest) == completed_transaction)) {
+        if (page_owner(latest) != 0) {
+            if (stm_verbose & 2)
+                fprintf(stderr, "Transaction %d owns page %lx while transaction %d is snapshotting it. [2]\n",
+                        page_owner(latest), page_num, seg->transaction_id);
+            collision_histo[3]++;
+            *error = STM_BUSY_ERROR;
+        } else {
+            if (stm_verbose & 2)
+                fprintf(stderr, "Transaction %d snuck in on transaction %d on page %lx during snapshot\n", 
+                        page_version(latest), completed_transaction, page_num);
+            collision_histo[4]++;
+            *error = STM_COLLISION_ERROR;
+        }
+        note_page_contention(seg, page_table_elt, is_write);
+        return 1;
+    }
+    
+    if (is_write && (status = upgrade_snapshot_page(seg, sl, page_table_elt, page_num, error)) != 0)
+        return status;
+    
+    return 0;
+}
+
+
+// Between transactions, the pages of a segment stay inaccessible until they are touched, so that starting a
+// transaction only has to take away access to the pages touched since the last one.  Here the first access to a
+// page between transactions is let through as far as the segment's default protection allows, and the page is
+// recorded in the segment's granted ranges.  is_write is -1 if the kind of access is not known; write_protected
+// is for the userfaultfd engine, and says the page is already there.
+//
+// returns 0, or -1 if the access is not allowed or there is an error, with *error set.
+//
+static int outside_transaction_fault(shared_segment *seg, void *va, int write_protected, int is_write, int *error) {
+    void *page_base = (void*)((long)va & ~(seg->page_size-1));
+    snapshot_element *sl;
+    int allowed;
+    
+    // A warm page can already be read, so this is a write, and the page will have to be dealt with as one of
+    // the granted pages from now on.
+    
+    if ((sl = find_in_snapshot_set(seg, page_base)) != NULL) {
+        drop_snapshot_element(seg, sl);
+        is_write = 1;
+    }
+    
+    if (is_write < 0)   // if the page was already granted, it must have been an access we don't allow.
+        allowed = seg->default_prot_flags != PROT_NONE && !page_is_granted(seg, page_base);
+    else
+        allowed = (seg->default_prot_flags & (is_write ? PROT_WRITE : PROT_READ)) != 0;
+    
+    if (!allowed) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "outside_transaction_fault: virtual address %lx referenced outside transaction\n",
+                    (unsigned long)va);
+        *error = STM_ACCESS_ERROR;
+        return -1;
+    }
+    
+    if (add_granted_page(seg, page_base, error) != 0)
+        return -1;
+    
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD) {
+        if (!write_protected && grant_read_access(seg, page_base, error) != 0)
+            return -1;
+        if ((seg->default_prot_flags & PROT_WRITE) && grant_write_access(seg, page_base, error) != 0)
+            return -1;
+        return 0;
+    }
+#endif
+    
+    if (mprotect(page_base, seg->page_size, seg->default_prot_flags) == -1) {
+        if (stm_verbose & 1)
+            perror("outside_transaction_fault: mprotect error");
+        *error = STM_MMAP_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+
+// signal_handler is invoked when there is a read or write access to a shared segment, for segments using the
+// signal fault engine.
+
+static void signal_handler(int sig, siginfo_t *si, void *foo) {
+    shared_segment *seg;
+    int status, error = 0;
+    
+    struct sigaction sa;
+    
+    (void)sig;      // always PAGE_ACCESS_SIGNAL
+    
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_DFL;
+    
+    seg = stm_find_shared_segment(si->si_addr);
+    
+    if (seg != NULL && seg->engine == STM_ENGINE_SIGNAL && seg->transaction_id == 0 && seg->in_transaction &&
+        (status = enroll_segment(seg, &error)) != 0)
+        transaction_error_exit(error, status);
+    
+    if (seg != NULL && seg->engine == STM_ENGINE_SIGNAL && seg->transaction_id == 0) {
+        if (outside_transaction_fault(seg, si->si_addr, 0, fault_is_write(foo), &error) == 0)
+            return;
+        
+        // Let the access fail as it would have without us.
+        set_stm_errno(error);
+        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
+        return;
+    }
+    
+    if (transaction_stack() == NULL) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "signal_handler: virtual address %lx referenced outside transaction\n",
+                    (unsigned long)si->si_addr);
+        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
+        transaction_error_exit(STM_ACCESS_ERROR, -1);       
+        return;
+    }
+    
+
+    if (seg == NULL) {
+        if (stale_transaction()) {
+            collision_histo[9]++;
+            transaction_error_exit(STM_COLLISION_ERROR, 1);
+            return;
+        }
+        if (stm_verbose & 1)
+            fprintf(stderr, "signal_handler: virtual address %lx not found in shared segment\n",
+                    (unsigned long)si->si_addr);
+        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
+        transaction_error_exit(STM_ACCESS_ERROR, -1);               
+        return;
+    }
+    
+    if (seg->engine != STM_ENGINE_SIGNAL) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "signal_handler:  signal received on userfaultfd segment\n");
+        sigaction(PAGE_ACCESS_SIGNAL, &sa, 0);
+        transaction_error_exit(STM_ACCESS_ERROR, -1);               
+    }
+    
+    if ((status = page_fault(seg, si->si_addr, fault_is_write(foo) > 0, &error)) != 0)
+        transaction_error_exit(error, status);
+    
+    return;
+}
+
+
+#ifdef HAVE_USERFAULTFD
+
+// With the userfaultfd engine, a segment is private anonymous memory, registered with userfaultfd(2) for missing
+// pages and for write protection.  A thread per process reads the faults and handles them with page_fault() on
+// behalf of the faulting thread, which stays blocked in the kernel meanwhile.  Pages are copied in from the
+// segment's shared view, write protected, on first access, and the protection is lifted on the first write.
+// When the transaction is over, the pages it touched are dropped again so the next access faults.
+//
+// The faulting thread can't be longjmp'd from another thread, so when its transaction has to abort, the handler
+// thread leaves the fault unresolved and queues UFFD_ABORT_SIGNAL to it instead.  That interrupts the fault, and
+// uffd_abort_handler() aborts the transaction at the faulting instruction, just as signal_handler() would have.
+
+static void queue_abort_signal(pid_t tid, int error, int status) {
+    siginfo_t info;
+    
+    memset(&info, 0, sizeof(info));
+    info.si_signo = UFFD_ABORT_SIGNAL;
+    info.si_code = SI_QUEUE;
+    info.si_pid = getpid();
+    info.si_uid = getuid();
+    info.si_value.sival_int = (status > 0) ? error : -error;
+    
+    if (syscall(SYS_rt_tgsigqueueinfo, getpid(), tid, UFFD_ABORT_SIGNAL, &info) == -1)
+        perror("queue_abort_signal: error signaling faulting thread");
+}
+
+static void uffd_abort_handler(int sig, siginfo_t *si, void *foo) {
+    int value = si->si_value.sival_int;
+    struct sigaction sa;
+    
+    (void)sig;      // always UFFD_ABORT_SIGNAL
+    (void)foo;
+    
+    if (transaction_stack() == NULL) {
+        // Nothing to abort; the access was simply not allowed.  Fail the way the access would have without us.
+        sa.sa_flags = 0;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = SIG_DFL;
+        sigaction(SIGSEGV, &sa, 0);
+        raise(SIGSEGV);
+        return;
+    }
+    
+    transaction_error_exit((value > 0) ? value : -value, (value > 0) ? 1 : -1);
+}
+
+
+static void *uffd_handler(void *arg) {
+    struct uffd_msg msg;
+    struct uffdio_range range;
+    shared_segment *seg;
+    void *va;
+    int status, error, is_write, write_protected;
+    
+    (void)arg;
+    
+    in_uffd_handler = 1;
+    for (;;) {
+        if (read(uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("uffd_handler: error reading userfaultfd");
+            return NULL;
+        }
+        
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+        
+        va = (void*)(unsigned long)msg.arg.pagefault.address;
+        write_protected = (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) != 0;
+        is_write = write_protected || (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0;
+        error = 0;
+        
+        if ((seg = lock_uffd_segment(va)) == NULL) {
+            if (stm_verbose & 1)
+                fprintf(stderr, "uffd_handler: virtual address %lx not found in shared segment\n", (unsigned long)va);
+            error = STM_ACCESS_ERROR;
+            status = -1;
+        } else if (seg->transaction_id == 0 && !seg->in_transaction) {
+            status = outside_transaction_fault(seg, va, write_protected, is_write, &error);
+        } else if (seg->transaction_id != 0 || (status = enroll_segment(seg, &error)) == 0) {
+            status = page_fault(seg, va, is_write, &error);
+        }
+        
+        if (status == 0) {
+            range.start = (unsigned long)va & ~(seg->page_size-1);
+            range.len = seg->page_size;
+            if (ioctl(uffd, UFFDIO_WAKE, &range) == -1)
+                perror("uffd_handler: UFFDIO_WAKE error");
+        } else {
+            queue_abort_signal(msg.arg.pagefault.feat.ptid, error, status);
+        }
+        pthread_mutex_unlock(&uffd_segments_lock);
+    }
+    return NULL;
+}
+
+
+// A child process doesn't inherit the thread that serves the userfaultfd, and the userfaultfd itself only serves
+// the parent's memory, so the child drops it, and makes its own when it opens a segment.  The segments it inherits
+// are no longer watched by anything, so it has to open its own.
+//
+static void uffd_prepare_fork() {
+    pthread_mutex_lock(&uffd_segments_lock);
+}
+
+static void uffd_parent_after_fork() {
+    pthread_mutex_unlock(&uffd_segments_lock);
+}
+
+static void uffd_child_after_fork() {
+    if (uffd >= 0)
+        close(uffd);
+    uffd = -1;
+    uffd_segments = NULL;
+    pthread_mutex_unlock(&uffd_segments_lock);
+}
+
+// Creates the process's userfaultfd, and the thread that serves it, the first time they are needed.
+//
+static int init_userfaultfd() {
+    static int fork_handlers;
+    struct uffdio_api api;
+    struct sigaction sa;
+    pthread_t thread;
+    int fd;
+    
+    pthread_mutex_lock(&uffd_segments_lock);
+    if (uffd >= 0) {
+        pthread_mutex_unlock(&uffd_segments_lock);
+        return 0;
+    }
+    
+    if ((fd = syscall(SYS_userfaultfd, O_CLOEXEC)) == -1) {
+        if (stm_verbose & 1)
+            perror("init_userfaultfd: userfaultfd not available");
+        pthread_mutex_unlock(&uffd_segments_lock);
+        return -1;
+    }
+    
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_THREAD_ID|UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(fd, UFFDIO_API, &api) == -1) {
+        if (stm_verbose & 1)
+            perror("init_userfaultfd: userfaultfd does not support write protection");
+        close(fd);
+        pthread_mutex_unlock(&uffd_segments_lock);
+        return -1;
+    }
+    
+    sa.sa_flags = SA_SIGINFO|SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = uffd_abort_handler;
+    sigaction(UFFD_ABORT_SIGNAL, &sa, NULL);
+    
+    uffd = fd;
+    if (pthread_create(&thread, NULL, uffd_handler, NULL) != 0) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "init_userfaultfd: could not start handler thread\n");
+        close(fd);
+        uffd = -1;
+        pthread_mutex_unlock(&uffd_segments_lock);
+        return -1;
+    }
+    pthread_detach(thread);
+    
+    if (!fork_handlers++)
+        pthread_atfork(uffd_prepare_fork, uffd_parent_after_fork, uffd_child_after_fork);
+    
+    pthread_mutex_unlock(&uffd_segments_lock);
+    return 0;
+}
+
+#endif // HAVE_USERFAULTFD
+
+
+int stm_set_fault_engine(int engine) {
+    switch (engine) {
+        case STM_ENGINE_SIGNAL:
+            stm_fault_engine = engine;
+            return 0;
+            
+#ifdef HAVE_USERFAULTFD
+        case STM_ENGINE_USERFAULTFD:
+            if (init_userfaultfd() != 0)
+                break;
+            stm_fault_engine = engine;
+            return 0;
+#endif
+    }
+    
+    set_stm_errno(STM_ENGINE_ERROR);
+    return -1;
+}
+
+int stm_set_validation(int validation) {
+    if (validation != STM_VALIDATE_TRANSACTION_IDS && validation != STM_VALIDATE_VERSION_CLOCK) {
+        set_stm_errno(STM_VALIDATION_ERROR);
+        return -1;
+    }
+    stm_validation = validation;
+    return 0;
+}
+
+void stm_set_visible_readers(int enable) {
+    stm_visible_readers = enable;
+}
+
+void stm_set_registry_size(int max_active_transactions) {
+    if (max_active_transactions < 1)
+        max_active_transactions = 1;
+    stm_registry_slots = (max_active_transactions + 63) & ~63;
+}
+
+static struct sigaction saved_sigaction;
+
+int stm_init(int verbose) {
+    
+    int status; 
+    struct sigaction sa;
+    
+    stm_verbose = verbose;
+    set_stm_errno(0);
+    
+    pageops_init();
+    
+    sa.sa_flags = SA_SIGINFO|SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = signal_handler;
+    
+    if ((status = sigaction(PAGE_ACCESS_SIGNAL, &sa, &saved_sigaction)) != 0) {     
+        if (stm_verbose & 1)
+            fprintf(stderr, "sigaction status = %d\n", status);
+        set_stm_errno(STM_SIGNAL_ERROR);
+    }
+    
+    create_thread_keys();
+    stm_init_thread_locals();
+    
+    return status;
+    
+}
+
+// Irrevocable transactions.  While a thread holds a segment's irrevocable token, no other transaction starts on
+// the segment, and none commits changes to it, so a transaction that holds the tokens of all its segments can't
+// be aborted by conflicts.  Commits that change pages count themselves in committers while they run, and the
+// holder waits for those already under way before it goes on.  Tokens are always taken in the order of the
+// segment list, so two transactions that want the same ones don't deadlock.
+//
+// The holder is known by its process and thread IDs, so that whoever is waiting for the token can tell if the
+// holder has died without giving it back, and take it back.  Waiters sleep on the half with the thread ID.
+// Likewise each commit counted in committers takes a place holding its process ID, so that the holder can take
+// back the count of a commit whose process died before it was done.  There are as many places as registry slots;
+// a commit that finds none free is counted without one, and can't be taken back.
+//
+
+#define holder_word(pid, tid) ((int64_t)(((uint64_t)(pid) << 32) | (uint32_t)(tid)))
+#define holder_pid(word) ((pid_t)((uint64_t)(word) >> 32))
+#define holder_tid(word) ((pid_t)(word))
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define holder_tid_half(td) ((uint32_t*)&(td)->irrevocable_holder)
+#else
+#define holder_tid_half(td) ((uint32_t*)&(td)->irrevocable_holder + 1)
+#endif
+
+// Returns the index of a place in pids taken for this process, or -1 if they are all taken.
+//
+static int take_pid_place(shared_segment *seg, int32_t *pids) {
+    int i, place, n = seg->registry_slots;
+    int32_t pid = getpid();
+    
+    for (i = 0; i < n; i++) {
+        place = (registry_hint(seg) * 64 + i) % n;
+        if (pids[place] == 0 && atomic_compare_and_swap_32(0, pid, &pids[place]))
+            return place;
+    }
+    return -1;
+}
+
+// Takes back the counts of commits whose processes have died.  Returns how many there were.
+//
+static int reclaim_dead_committers(shared_segment *seg) {
+    int i, reclaimed = 0;
+    int32_t pid;
+    
+    for (i = 0; i < seg->registry_slots; i++) {
+        if ((pid = *(volatile int32_t *)&seg->committer_pids[i]) != 0 && kill(pid, 0) == -1 && errno == ESRCH &&
+            atomic_compare_and_swap_32(pid, 0, &seg->committer_pids[i])) {
+            atomic_decrement_32(&seg->segment_transaction_data->committers);
+            atomic_increment_32(&dead_committers);
+            reclaimed++;
+        }
+    }
+    if (reclaimed && (stm_verbose & 1))
+        fprintf(stderr, "reclaim_dead_committers: took back %d commits from dead processes\n", reclaimed);
+    return reclaimed;
+}
+
+// Sleep until holder no longer holds the token.  If the holder's thread is gone, the token is taken from it.
+//
+static void wait_for_holder(transaction_data *td, int64_t holder) {
+    atomic_wait_while_equal(holder_tid_half(td), (uint32_t)holder_tid(holder), STM_HOLDER_CHECK_USEC);
+    
+    if (atomic_read_64(&td->irrevocable_holder) == holder &&
+        syscall(SYS_tgkill, holder_pid(holder), holder_tid(holder), 0) == -1 && errno == ESRCH &&
+        atomic_compare_and_swap_64(holder, 0, &td->irrevocable_holder)) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "wait_for_holder: took back the irrevocable token from dead thread %d of process %d\n",
+                    holder_tid(holder), holder_pid(holder));
+        atomic_wake_all(holder_tid_half(td));
+    }
+}
+
+static void take_irrevocable_token(shared_segment *seg) {
+    transaction_data *td = seg->segment_transaction_data;
+    int64_t holder;
+    int32_t committers;
+    
+    if (seg->irrevocable)
+        return;
+    while (!atomic_compare_and_swap_64(0, holder_word(getpid(), thread_id()), &td->irrevocable_holder)) {
+        if ((holder = atomic_read_64(&td->irrevocable_holder)) != 0)
+            wait_for_holder(td, holder);
+    }
+    seg->irrevocable = 1;
+    
+    // The commits already under way have their pages locked, and will be done with them soon.  No new ones can
+    // start, so this only waits for those, unless they are taking so long because their processes are dead.
+    
+    while ((committers = *(volatile int32_t *)&td->committers) != 0) {
+        atomic_wait_while_equal((uint32_t *)&td->committers, committers, STM_HOLDER_CHECK_USEC);
+        if (*(volatile int32_t *)&td->committers == committers)
+            reclaim_dead_committers(seg);
+    }
+}
+
+static void release_irrevocable_token(shared_segment *seg) {
+    if (!seg->irrevocable)
+        return;
+    seg->irrevocable = 0;
+    atomic_swap_64(0, &seg->segment_transaction_data->irrevocable_holder);
+    atomic_wake_all(holder_tid_half(seg->segment_transaction_data));
+}
+
+// Wait for whoever holds the segment's irrevocable token to be done with it, unless it is us.
+//
+static void wait_for_irrevocable_token(shared_segment *seg) {
+    transaction_data *td = seg->segment_transaction_data;
+    int64_t holder;
+    
+    while ((holder = atomic_read_64(&td->irrevocable_holder)) != 0 && !seg->irrevocable)
+        wait_for_holder(td, holder);
+}
+
+static void leave_commit_gate() {
+    shared_segment *seg;
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (!seg->committing)
+            continue;
+        seg->committing = 0;
+        if (seg->committer_place >= 0)
+            atomic_swap_32(0, &seg->committer_pids[seg->committer_place]);
+        atomic_decrement_32(&seg->segment_transaction_data->committers);
+        if (atomic_read_64(&seg->segment_transaction_data->irrevocable_holder))
+            atomic_wake_all((uint32_t *)&seg->segment_transaction_data->committers);
+    }
+}
+
+// Before a commit changes any pages, it counts itself in committers on each segment it has written, unless some
+// other transaction holds the segment's token, in which case it waits.  It doesn't wait while counted anywhere,
+// which could deadlock with a holder waiting for it.
+//
+static void enter_commit_gate() {
+    shared_segment *seg;
+    int64_t holder;
+    
+restart:
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->transaction_id == 0 || seg->arena_used == 0 || seg->irrevocable)
+            continue;
+        seg->committing = 1;
+        atomic_increment_32(&seg->segment_transaction_data->committers);
+        seg->committer_place = take_pid_place(seg, seg->committer_pids);
+        if ((holder = atomic_read_64(&seg->segment_transaction_data->irrevocable_holder)) != 0) {
+            leave_commit_gate();
+            wait_for_holder(seg->segment_transaction_data, holder);
+            goto restart;
+        }
+    }
+}
+
+// Whether the pages a transaction has accessed are all still as they were, written or not.
+//
+static int read_set_unchanged(shared_segment *seg) {
+    snapshot_element *sl;
+    int64_t word;
+    
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+        word = read_page_word(&seg->segment_page_table[(sl->original_page_va - seg->shared_base_va)/seg->page_size]);
+        if (sl->snapshot_transaction_id != page_version(word) ||
+            (page_owner(word) != 0 && page_owner(word) != seg->transaction_id))
+            return 0;
+    }
+    return 1;
+}
+
+// Closed nesting.  A nested transaction started with closed nesting on is retryable:  each segment gets a
+// nesting mark, saying where its snapshot set, snapshot arena and pre-images stood, and the pages written so far
+// are write protected, so that the first write to each in the nested transaction saves a copy of it first (see
+// save_preimage()).  When the nested transaction has a conflict, everything after its marks is undone, and if
+// what the transactions around it have read is all still as it was, just the nested transaction is retried,
+// from the sigsetjmp() in its stm_start_transaction().  If a page they read has changed, the next transaction
+// out is tried the same way, and so on out to the outermost, which is aborted and retried as usual.
+//
+// Only segments using the version clock can do this, since they can move their transaction forward to a newer
+// commit_sequence without changing anything they have read.  With transaction IDs the transaction is fixed in
+// the order of transactions when it starts.
+
+sigjmp_buf *_stm_retry_jmp_buf() {
+    shared_segment *seg;
+    
+    if (transaction_stack() == NULL)
+        return stm_jmp_buf();
+    
+    if (!stm_closed_nesting)
+        return NULL;
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->in_transaction && seg->validation != STM_VALIDATE_VERSION_CLOCK)
+            return NULL;
+    }
+    
+    if (pending_transaction == NULL && (pending_transaction = calloc(1, sizeof(transaction_stack_element))) == NULL)
+        return NULL;
+    pending_transaction->retryable = 1;
+    pending_transaction->retries = 0;
+    return &pending_transaction->retry_buf;
+}
+
+// Write protect the pages written so far that aren't already, a run of adjacent pages at a time.
+//
+static int protect_written_pages(shared_segment *seg, int *error) {
+    snapshot_element *sl, *run, *end;
+    size_t n_pages;
+    
+    for (sl = seg->snapshots, end = seg->snapshots + seg->n_snapshots; sl < end; ) {
+        if (!sl->page_writable || sl->nest_protected) {
+            sl++;
+            continue;
+        }
+        run = sl;
+        n_pages = 0;
+        do {
+            sl->nest_protected = 1;
+            n_pages++;
+            sl++;
+        } while (sl < end && sl->original_page_va == run->original_page_va + n_pages * seg->page_size &&
+                 sl->page_writable && !sl->nest_protected);
+        
+        if (set_page_run_writable(seg, run->original_page_va, n_pages, 0, error) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int start_nested_transaction() {
+    shared_segment *seg;
+    nesting_mark *marks;
+    int max, error;
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (!seg->in_transaction)
+            continue;
+        if (seg->n_nesting_marks == seg->max_nesting_marks) {
+            max = seg->max_nesting_marks ? 2 * seg->max_nesting_marks : 4;
+            if ((marks = realloc(seg->nesting_marks, max * sizeof(nesting_mark))) == NULL) {
+                set_stm_errno(STM_ALLOC_ERROR);
+                return -1;
+            }
+            seg->nesting_marks = marks;
+            seg->max_nesting_marks = max;
+        }
+        seg->nesting_marks[seg->n_nesting_marks].n_snapshots = seg->n_snapshots;
+        seg->nesting_marks[seg->n_nesting_marks].arena_used = seg->arena_used;
+        seg->nesting_marks[seg->n_nesting_marks].n_preimages = seg->n_preimages;
+        seg->n_nesting_marks++;
+        
+        if (protect_written_pages(seg, &error) != 0) {
+            set_stm_errno(error);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// What a retryable nested transaction did becomes part of the transaction around it.  The pre-images it saved
+// stay, since they are also what the pages were when that transaction started, if it hadn't written them yet.
+//
+static void commit_nested_transaction() {
+    shared_segment *seg;
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->n_nesting_marks > 0 && --seg->n_nesting_marks == 0) {
+            seg->n_preimages = 0;
+            seg->preimages_overflowed = 0;
+        }
+    }
+}
+
+// Undo what happened in a segment since mark.  Pages written before then get their pre-images back, and are
+// protected again.  Pages read before then and first written since go back to being read only, with the contents
+// of the shared page, which the caller has to check are still what we read.  Pages first touched since are
+// dropped from the snapshot set.  Returns 0, or -1 if the segment can't be put back.
+//
+static int roll_back_nested_transaction(shared_segment *seg, nesting_mark *mark) {
+    snapshot_element *sl;
+    page_table_element *page_table_elt;
+    void *page_base;
+    int i, error;
+    
+    if (seg->preimages_overflowed)
+        return -1;
+    
+    for (i = seg->n_preimages - 1; i >= mark->n_preimages; i--) {
+        page_base = seg->shared_base_va + (size_t)seg->preimage_pages[i] * seg->page_size;
+        sl = find_in_snapshot_set(seg, page_base);
+        if (sl->nest_protected && set_page_run_writable(seg, page_base, 1, 1, &error) != 0)
+            return -1;
+        page_copy(page_base, seg->preimage_arena + i * seg->page_size, seg->page_size);
+        if (set_page_run_writable(seg, page_base, 1, 0, &error) != 0)
+            return -1;
+        sl->nest_protected = 1;
+    }
+    seg->n_preimages = mark->n_preimages;
+    
+    for (sl = seg->snapshots + seg->n_snapshots - 1; sl >= seg->snapshots; sl--) {
+        if (sl < seg->snapshots + mark->n_snapshots &&
+            (!sl->page_writable ||
+             sl->original_page_snapshot < seg->snapshot_arena + mark->arena_used * seg->page_size))
+            continue;
+        
+        page_table_elt = &seg->segment_page_table[(sl->original_page_va - seg->shared_base_va)/seg->page_size];
+        unlock_page(seg, page_table_elt, 0, 0);
+        
+        if (sl >= seg->snapshots + mark->n_snapshots) {
+            if (revoke_page_run(seg, sl->original_page_va, 1, sl->page_writable) != 0)
+                return -1;
+            drop_snapshot_element(seg, sl);
+        } else {
+            if (revoke_page_run(seg, sl->original_page_va, 1, 1) != 0 ||
+                grant_read_access(seg, sl->original_page_va, &error) != 0)
+                return -1;
+            sl->page_writable = 0;
+            sl->nest_protected = 0;
+            sl->original_page_snapshot = NULL;
+            sl->changed_lines = NULL;
+        }
+    }
+    seg->arena_used = mark->arena_used;
+    return 0;
+}
+
+// Called on a conflict, before the whole transaction is aborted.  Retries the innermost retryable transaction
+// that can be, and only returns if none can.
+//
+static void retry_nested_transaction() {
+    transaction_stack_element *trans;
+    shared_segment *seg;
+    int32_t sequence;
+    int valid;
+    
+    while ((trans = transaction_stack()) != NULL && trans->next != NULL && trans->retryable) {
+        for (seg = shared_segment_list(); seg; seg = seg->next) {
+            if (seg->in_transaction && seg->n_nesting_marks > 0 &&
+                roll_back_nested_transaction(seg, &seg->nesting_marks[--seg->n_nesting_marks]) != 0)
+                return;
+        }
+        set_transaction_stack(trans->next);
+        
+        // The transactions around it can go on as of now, if nothing they have read has changed.
+        
+        valid = 1;
+        for (seg = shared_segment_list(); seg && valid; seg = seg->next) {
+            if (seg->transaction_id == 0)
+                continue;
+            sequence = seg->segment_transaction_data->commit_sequence;
+            if ((valid = read_set_unchanged(seg)))
+                seg->validated_sequence = sequence;
+        }
+        
+        if (valid && trans->retries < STM_NESTED_RETRIES) {
+            trans->retries++;
+            atomic_increment_32(&nested_retries);
+            if (pending_transaction)
+                free(pending_transaction);
+            pending_transaction = trans;
+            siglongjmp(trans->retry_buf, 1);
+        }
+        
+        // Otherwise try the transaction around it.
+        
+        free(trans);
+    }
+}
+
+void stm_set_closed_nesting(int enable) {
+    stm_closed_nesting = enable;
+}
+
+// The pages the transaction has read are noted before it is aborted, so that it can then sleep on the version
+// halves of their words, which unlock_page() wakes as it changes them.  Counting ourselves in retry_waiters first
+// means that a commit either changes a page before we look at it, or sees that it has to wake us.
+//
+int stm_retry() {
+    shared_segment *seg;
+    snapshot_element *sl;
+    page_table_element *page_table_elt;
+    uint32_t **addrs;
+    uint32_t *vals;
+    struct timespec now;
+    long remaining;
+    int i, n = 0, changed;
+    
+    if (transaction_stack() == NULL) {
+        if (stm_verbose & 1)
+            fprintf(stderr, "stm_retry: not in a transaction\n");
+        set_stm_errno(STM_TRANS_STACK_ERROR);
+        return -1;
+    }
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->transaction_id != 0)
+            n += seg->n_snapshots;
+    }
+    addrs = malloc((n ? n : 1) * sizeof(uint32_t *));
+    vals = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (addrs == NULL || vals == NULL) {
+        free(addrs);
+        free(vals);
+        transaction_error_exit(STM_ALLOC_ERROR, -1);
+    }
+    
+    n = 0;
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->transaction_id == 0)
+            continue;
+        atomic_increment_32(&seg->segment_transaction_data->retry_waiters);
+        seg->retry_waiting = 1;
+        for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+            page_table_elt = &seg->segment_page_table[(sl->original_page_va - seg->shared_base_va)/seg->page_size];
+            addrs[n] = page_version_half(page_table_elt);
+            vals[n++] = sl->snapshot_transaction_id;
+        }
+    }
+    
+    stm_abort_transaction(0);
+    atomic_increment_32(&retry_waits);
+    
+    // A transaction that read nothing has nothing to wait for.  One started with stm_start_transaction_limited()
+    // only waits until its timeout, and then gives up when it is started again.
+    
+    for (changed = (n == 0); !changed; ) {
+        for (i = 0; i < n && !changed; i++)
+            changed = (*(volatile uint32_t *)addrs[i] != vals[i]);
+        if (changed)
+            break;
+        if (contention.timeout) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = contention.timeout - ((now.tv_sec - contention.started.tv_sec) * 1000000000L +
+                                              (now.tv_nsec - contention.started.tv_nsec));
+            if (remaining < 1000)
+                break;
+            atomic_wait_while_all_equal(addrs, vals, n, remaining / 1000);
+        } else {
+            atomic_wait_while_all_equal(addrs, vals, n, 0);
+        }
+    }
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->retry_waiting) {
+            atomic_decrement_32(&seg->segment_transaction_data->retry_waiters);
+            seg->retry_waiting = 0;
+        }
+    }
+    free(addrs);
+    free(vals);
+    
+    set_stm_errno(STM_RETRY_ERROR);
+    siglongjmp(*stm_jmp_buf(), 1);
+}
+
+int stm_become_irrevocable() {
+    shared_segment *seg;
+    
+    if (transaction_stack() == NULL) {
+        set_stm_errno(STM_TRANS_STACK_ERROR);
+        return -1;
+    }
+    if (!contention.irrevocable)
+        atomic_increment_32(&irrevocable_transactions);
+    contention.irrevocable = 1;
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->in_transaction)
+            take_irrevocable_token(seg);
+    }
+    
+    // If anything we have read has changed, start again, this time holding the tokens from the start.
+    
+    for (seg = shared_segment_list(); seg; seg = seg->next) {
+        if (seg->transaction_id != 0 && !read_set_unchanged(seg)) {
+            collision_histo[9]++;
+            transaction_error_exit(STM_COLLISION_ERROR, 1);
+        }
+    }
+    return 0;
+}
+
+void stm_set_irrevocable_after(int retries, long nanoseconds) {
+    stm_irrevocable_retries = retries;
+    stm_irrevocable_age = nanoseconds;
+}
+
+
+// Check the warm pages against the current versions of the pages, now that the transaction has an ID and will
+// find out from commit_sequence about any later changes.  A page that has changed, or is being changed, is made
+// inaccessible again, so the transaction will fault on it like any other.
+//
+static int validate_warm_pages(shared_segment *seg) {
+    snapshot_element *sl;
+    page_table_element *page_table_elt;
+    size_t page_num;
+    
+    for (sl = seg->snapshots + seg->n_snapshots - 1; sl >= seg->snapshots; sl--) {
+        page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;
+        page_table_elt = &seg->segment_page_table[page_num];
+        mark_page_read(seg, page_num);
+        if (read_page_word(page_table_elt) != page_word(0, sl->snapshot_transaction_id)) {
+            if (revoke_page_run(seg, sl->original_page_va, 1, 0) != 0)
+                return -1;
+            drop_snapshot_element(seg, sl);
+        }
+    }
+    return 0;
+}
+
+// Admission control.  When transactions on a segment keep aborting each other, letting fewer of them in at
+// once gets more of them done.  A transaction is let in the first time it writes the segment, and counted as
+// committed or aborted when it ends.  Transactions that only read are never held up, since they can't make
+// anybody else abort.  The limit is adjusted from the counts by whoever ends the last transaction of each window.
+// The holder of the irrevocable token doesn't have to wait, and isn't counted.
+//
+// Each transaction let in also takes a place holding its process ID, so that if its process dies, whoever is
+// kept waiting too long can take its place back.  There is a place for as many transactions as the registry
+// holds, which is as high as the limit goes, so only transactions let in over the limit can be without one.
+//
+
+// Returns how many places were taken back.
+//
+static int reclaim_dead_admissions(shared_segment *seg) {
+    int i, reclaimed = 0;
+    int32_t pid;
+    
+    for (i = 0; i < seg->registry_slots; i++) {
+        if ((pid = *(volatile int32_t *)&seg->admission_pids[i]) != 0 && kill(pid, 0) == -1 && errno == ESRCH &&
+            atomic_compare_and_swap_32(pid, 0, &seg->admission_pids[i])) {
+            atomic_decrement_32(&seg->segment_transaction_data->admitted);
+            atomic_increment_32(&dead_admissions);
+            reclaimed++;
+        }
+    }
+    return reclaimed;
+}
+
+// Returns 0 once the transaction has been let in, or 1 if it would have to wait and can't, because this is the
+// userfaultfd thread, in which case the transaction should be aborted.
+//
+static int admit_transaction(shared_segment *seg) {
+    transaction_data *td = seg->segment_transaction_data;
+    struct timespec start, now;
+    long waited = 0;
+    int waiting = 0, reclaimed = 0;
+    int32_t admitted;
+    
+    if (!stm_admission_control || seg->irrevocable || seg->admitted)
+        return 0;
+    
+    for (;;) {
+        admitted = *(volatile int32_t *)&td->admitted;
+        if (admitted < *(volatile int32_t *)&td->admission_limit || waited >= STM_ADMISSION_WAIT_USEC) {
+            if (atomic_compare_and_swap_32(admitted, admitted + 1, &td->admitted))
+                break;
+            continue;
+        }
+        if (in_uffd_handler)
+            return 1;
+        if (!waiting++) {
+            atomic_increment_32(&admission_waits);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        atomic_increment_32(&td->admission_waiters);
+        atomic_wait_while_equal((uint32_t *)&td->admitted, admitted, STM_ADMISSION_WAIT_USEC - waited);
+        atomic_decrement_32(&td->admission_waiters);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+        
+        // If the transactions in have had the places so long because some of them are dead, taking their
+        // places back may let us in properly.
+        
+        if (waited >= STM_ADMISSION_WAIT_USEC && !reclaimed++ && reclaim_dead_admissions(seg) > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            waited = 0;
+        }
+    }
+    if (waited >= STM_ADMISSION_WAIT_USEC)
+        atomic_increment_32(&admission_timeouts);
+    seg->admitted = 1;
+    seg->admission_place = take_pid_place(seg, seg->admission_pids);
+    return 0;
+}
+
+// outcome is 1 if the transaction committed, 0 if it was aborted, or -1 if it didn't touch the segment, which
+// says nothing about contention on it.
+//
+static void release_admission(shared_segment *seg, int outcome) {
+    transaction_data *td = seg->segment_transaction_data;
+    int32_t aborts, admitted, limit;
+    
+    if (!seg->admitted)
         return;
-        
+    seg->admitted = 0;
+    if (seg->admission_place >= 0)
+        atomic_swap_32(0, &seg->admission_pids[seg->admission_place]);
+    
+    if (outcome >= 0) {
+        if (outcome == 0)
+            atomic_increment_32(&td->admission_aborts);
+        if (atomic_increment_32(&td->admission_outcomes) % STM_ADMISSION_WINDOW == 0) {
+            aborts = atomic_swap_32(0, &td->admission_aborts);
+            admitted = *(volatile int32_t *)&td->admitted;
+            limit = *(volatile int32_t *)&td->admission_limit;
+            
+            // Halve the number actually getting in, which may be far less than the limit.
+            
+            if (aborts * 2 >= STM_ADMISSION_WINDOW)
+                limit = (admitted < limit) ? admitted / 2 : limit / 2;
+            else if (aborts * 4 < STM_ADMISSION_WINDOW)
+                limit++;
+            if (limit < 1)
+                limit = 1;
+            if (limit > td->registry_slots)
+                limit = td->registry_slots;
+            atomic_swap_32(limit, &td->admission_limit);
+        }
     }
     
-    // Some systems evidently allow changes by other processes to be reflected in private mappings.
-    // To prevent that (hopefully!) we modify the page (without really changing anything) to 
-    // invoke the "copy-on-write" semantics and really make a private copy
-    //
-    *(volatile int*)page_base = defeat_optimizer((volatile int*)page_base);
-#endif
+    atomic_decrement_32(&td->admitted);
+    if (*(volatile int32_t *)&td->admission_waiters)
+        atomic_wake_all((uint32_t *)&td->admitted);
+}
+
+void stm_set_admission_control(int enable) {
+    stm_admission_control = enable;
+}
+
+// Getting a segment ready for a transaction means making sure touching it will fault.  Pages touched during the
+// last transaction were made inaccessible at its end, so only pages touched since then need to be dealt with,
+// and if there are none, there is nothing to do.
+//
+// returns:
+//  0 - success
+// -1 - non-recoverable error
+//  1 - should retry
+//
+static int start_transaction_on_segment(shared_segment *seg) {
+    int status, error;
     
-    if (insert_into_snapshot_list(seg, page_base, completed_transaction) != 0) {
-        transaction_error_exit(0, -1);
-    }
+    wait_for_irrevocable_token(seg);
     
-    // Double check to make sure that during the above, nobody grabbed this page.
+    // Warm pages left by the last transaction can be read without faulting, so if there are any, the segment
+    // is in this transaction from the start, and those that have changed since have to go.
     
-    if (page_table_elt->current_transaction != 0) {
-        if (seg->transaction_id != page_table_elt->current_transaction) {
-            
-            if (stm_verbose & 2)
-                fprintf(stderr, "Transaction %d owns page %lx while transaction %d is snapshotting it. [2]\n",
-                        page_table_elt->current_transaction, page_num, seg->transaction_id);
-            collision_histo[3]++;
-            transaction_error_exit(STM_COLLISION_ERROR, 1);
-            return;
-        } else {
-#ifdef OPTIMISTIC_LOCKING
+    if (seg->n_snapshots > 0) {
+        if ((status = enroll_segment(seg, &error)) != 0) {
+            set_stm_errno(error);
+            return status;
+        }
+        if (validate_warm_pages(seg) != 0) {
             if (stm_verbose & 1)
-                fprintf(stderr, "Transaction %d already owns page %lx [2]\n", 
-                        page_table_elt->current_transaction, page_num);
-            transaction_error_exit(STM_OWNERSHIP_ERROR, -1);
-#endif
+                perror("start_transaction: error revoking access");
+            set_stm_errno(STM_MMAP_ERROR);
+            return -1;
         }
     }
     
-    if (completed_transaction != page_table_elt->completed_transaction) {
-        if (stm_verbose & 2) {
-            fprintf(stderr, "Transaction %d snuck in on transaction %d on page %lx during snapshot\n", 
-                    page_table_elt->completed_transaction, completed_transaction, page_num);
-        }
-        collision_histo[4]++;
-        transaction_error_exit(STM_COLLISION_ERROR, 1); 
-        return;
+    if (revoke_granted_ranges(seg) != 0) {
+        if (stm_verbose & 1)
+            perror("start_transaction: error revoking access");
+        set_stm_errno(STM_MMAP_ERROR);
+        return -1;
     }
     
-    return;
+    seg->in_transaction = 1;
+    return 0;
 }
 
+// The contention managers.
+//
+typedef struct contention_manager_entry {
+    struct contention_manager_entry *next;
+    char *trans_name;
+    stm_contention_manager cm;
+} contention_manager_entry;
 
-static struct sigaction saved_sigaction;
+static contention_manager_entry *contention_managers;      // by transaction name
+static stm_contention_manager default_contention_manager = stm_cm_backoff;
 
-int stm_init(int verbose) {
-    
-    int status; 
-    struct sigaction sa;
-    
-    stm_verbose = verbose;
-    set_stm_errno(0);
-    
-    sa.sa_flags = SA_SIGINFO;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_sigaction = signal_handler;
+int stm_set_contention_manager(char *trans_name, stm_contention_manager cm) {
+    contention_manager_entry *e;
     
-    if ((status = sigaction(PAGE_ACCESS_SIGNAL, &sa, &saved_sigaction)) != 0) {     
-        if (stm_verbose & 1)
-            fprintf(stderr, "sigaction status = %d\n", status);
-        set_stm_errno(STM_SIGNAL_ERROR);
+    if (cm == NULL)
+        cm = stm_cm_backoff;
+    if (trans_name == NULL) {
+        default_contention_manager = cm;
+        return 0;
+    }
+    for (e = contention_managers; e; e = e->next) {
+        if (strcmp(e->trans_name, trans_name) == 0) {
+            e->cm = cm;
+            return 0;
+        }
+    }
+    if ((e = calloc(1, sizeof(contention_manager_entry))) == NULL ||
+        (e->trans_name = strdup(trans_name)) == NULL) {
+        free(e);
+        set_stm_errno(STM_ALLOC_ERROR);
+        return -1;
     }
+    e->cm = cm;
+    e->next = contention_managers;
+    contention_managers = e;
+    return 0;
+}
+
+// A random number in [0, n), n > 0.
+//
+static long jitter(long n) {
+    uint32_t x = contention.seed;
+    
+    if (x == 0)
+        x = getpid() ^ (uint32_t)(uintptr_t)&contention ^ (uint32_t)contention.started.tv_nsec ^ 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    contention.seed = x;
+    return x % n;
+}
+
+long stm_cm_backoff(stm_contention *c) {
+    long ceiling;
     
-    create_thread_keys();
-    stm_init_thread_locals();
+    if (c->reason == STM_COLLISION_ERROR && c->retries == 1)
+        return 0;
+    ceiling = (c->retries < 20) ? (long)STM_MIN_DELAY << c->retries : STM_MAX_DELAY;
+    if (ceiling > STM_MAX_DELAY)
+        ceiling = STM_MAX_DELAY;
+    return ceiling/2 + jitter(ceiling/2);
+}
+
+// Every STM_CM_AGE_UNIT nanoseconds a transaction has been trying halves its wait.
+//
+#define STM_CM_AGE_UNIT 100000
+
+long stm_cm_timestamp(stm_contention *c) {
+    long shift = c->age / STM_CM_AGE_UNIT;
     
-    return status;
+    if (c->reason == STM_REGISTRY_FULL_ERROR)
+        return stm_cm_backoff(c);
+    return stm_cm_backoff(c) >> ((shift < 20) ? shift : 20);
+}
+
+// Every STM_CM_KARMA_UNIT pages a transaction has touched halves its wait.
+//
+#define STM_CM_KARMA_UNIT 16
+
+long stm_cm_karma(stm_contention *c) {
+    long shift = c->karma / STM_CM_KARMA_UNIT;
     
+    if (c->reason == STM_REGISTRY_FULL_ERROR)
+        return stm_cm_backoff(c);
+    return stm_cm_backoff(c) >> ((shift < 20) ? shift : 20);
 }
 
-static int start_transaction_on_segment(shared_segment *seg) {
-    int status;
-        
+long stm_cm_polite(stm_contention *c) {
+    long delay;
+    
+    if (c->reason == STM_REGISTRY_FULL_ERROR)
+        return stm_cm_backoff(c);
+    delay = (c->retries < 20) ? (long)STM_MIN_DELAY << (c->retries - 1) : STM_SPIN_DELAY;
+    delay = (delay < STM_SPIN_DELAY) ? delay : STM_SPIN_DELAY - 1;
+    return delay/2 + jitter(delay/2 + 1);
+}
 
-    // There is a small interval between the time we allocate a transaction ID and the time we can register it as an active
-    // transaction so other transactions can know of its existence.  So transaction startup has to be
-    // single threaded at least up until we add our new transaction ID to the active transactions list.
+void _stm_contention_start(long timeout) {
+    contention.timeout = timeout;
+    contention.retries = 0;
+    contention.karma = 0;
+    contention.irrevocable = 0;
+    clock_gettime(CLOCK_MONOTONIC, &contention.started);
+}
+
+int stm_abort_reason() {
+    return contention.reason;
+}
 
-    atomic_spin_lock_lock(&seg->segment_transaction_data->transaction_lock);
+// Called by the stm_start_transaction() macros before a retry, with stm_errno still saying why the last attempt
+// was aborted.  Returns 0 to retry, or 1 to give up, if max_attempts have been made (if not 0), or the next one
+// couldn't start within timeout nanoseconds of the first (if not 0).  A nested transaction retried by itself is
+// just retried.
+//
+int _stm_contention_retry(char *trans_name, int max_attempts, long timeout) {
+    return _stm_contention_retry_with(trans_name, max_attempts, timeout, NULL);
+}
 
-    if ((seg->transaction_id = atomic_increment_32((int32_t*)&seg->segment_transaction_data->transaction_counter)) == 0) {
-        // unlikely we'll wrap, but if we do, skip 0.
-        seg->transaction_id = atomic_increment_32((int32_t*)&seg->segment_transaction_data->transaction_counter);   
+// The same, with a contention manager of the caller's, if cm isn't NULL, rather than the one for trans_name.
+// For stm.hpp.
+//
+int _stm_contention_retry_with(char *trans_name, int max_attempts, long timeout, stm_contention_manager cm) {
+    contention_manager_entry *e;
+    stm_contention c;
+    struct timespec now, ts;
+    long delay, waited;
+    
+    if (transaction_stack() != NULL)    // a nested transaction, retried by itself
+        return 0;
+    
+    // After stm_retry(), what the transaction read has changed, so it is started again right away, and that isn't
+    // counted as an attempt.
+    
+    if (stm_errno() == STM_RETRY_ERROR) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        contention.reason = STM_RETRY_ERROR;
+        if (timeout && (now.tv_sec - contention.started.tv_sec) * 1000000000L +
+            (now.tv_nsec - contention.started.tv_nsec) >= timeout) {
+            set_stm_errno(STM_RETRY_LIMIT_ERROR);
+            return 1;
+        }
+        return 0;
     }
     
-    snapshot_active_transactions(seg);
-    add_active_transaction(seg);
-
-    atomic_spin_lock_unlock(&seg->segment_transaction_data->transaction_lock);
-        
-    if (seg->default_prot_flags != PROT_NONE) {
-        
-        status = mprotect(seg->shared_base_va, seg->shared_seg_size, PROT_NONE);
+    if (cm == NULL) {
+        cm = default_contention_manager;
+        for (e = contention_managers; e; e = e->next) {
+            if (strcmp(e->trans_name, trans_name) == 0) {
+                cm = e->cm;
+                break;
+            }
+        }
+    }
     
-        // status = mprotect(seg->shared_base_va, seg->shared_seg_size, PROT_READ|PROT_WRITE);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    c.trans_name = trans_name;
+    c.reason = stm_errno();
+    c.retries = ++contention.retries;
+    c.age = (now.tv_sec - contention.started.tv_sec) * 1000000000L + (now.tv_nsec - contention.started.tv_nsec);
+    c.karma = contention.karma;
+    contention.reason = c.reason;
+    
+    if ((max_attempts && c.retries >= max_attempts) || (timeout && c.age >= timeout)) {
+        set_stm_errno(STM_RETRY_LIMIT_ERROR);
+        return 1;
+    }
     
-        if (status == -1) {
-            if (stm_verbose & 1)
-                perror("start_transaction: mprotect error");
-            set_stm_errno(STM_MMAP_ERROR);
-                return -1;
-        }
+    // A transaction that has been trying too long is let through on its next attempt, which waits for the
+    // irrevocable tokens instead.
+    
+    if (!contention.irrevocable &&
+        ((stm_irrevocable_retries && c.retries >= stm_irrevocable_retries) ||
+         (stm_irrevocable_age && c.age >= stm_irrevocable_age))) {
+        atomic_increment_32(&irrevocable_transactions);
+        contention.irrevocable = 1;
+    }
+    if (contention.irrevocable)
+        return 0;
+    
+    if ((delay = cm(&c)) <= 0)
+        return 0;
+    
+    // No point in waiting past the deadline just to give up then.
+    
+    if (timeout && c.age + delay >= timeout) {
+        set_stm_errno(STM_RETRY_LIMIT_ERROR);
+        return 1;
+    }
+    
+    // Sleeping for any time at all takes tens of microseconds, so shorter waits are spent yielding.
+    
+    if (delay >= STM_SPIN_DELAY) {
+        ts.tv_sec = delay / 1000000000L;
+        ts.tv_nsec = delay % 1000000000L;
+        nanosleep(&ts, NULL);
+        return 0;
+    }
+    waited = 0;
+    while (waited < delay) {
+        sched_yield();
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        waited = (ts.tv_sec - now.tv_sec) * 1000000000L + (ts.tv_nsec - now.tv_nsec);
     }
-        
     return 0;
 }
 
-int _stm_start_transaction(char *trans_name) {
+// Starts a transaction on all of the thread's segments if segs is NULL, or else on just the n_segs segments in
+// segs.  The others are left as they are between transactions.
+//
+int _stm_start_transaction_on(char *trans_name, struct shared_segment **segs, int n_segs) {
     shared_segment *seg;
-    
+    int i, status;
         
     set_stm_errno(0);      // This is as good a place as any to re-initialize this error code to 0.
     
@@ -1044,12 +3692,29 @@ int _stm_start_transaction(char *trans_name) {
         transaction_error_exit(STM_NULL_NAME_ERROR, -1);    }
     
 
-    if (transaction_stack() == NULL)
-        for(seg = shared_segment_list(); seg; seg = seg->next) {
-            if (start_transaction_on_segment(seg) != 0) {
-                transaction_error_exit(0, -1);
+    if (transaction_stack() == NULL) {
+        if (contention.irrevocable) {
+            for (seg = shared_segment_list(); seg; seg = seg->next) {
+                for (i = 0; segs != NULL && i < n_segs && segs[i] != seg; i++)
+                    ;
+                if (segs == NULL || i < n_segs)
+                    take_irrevocable_token(seg);
+            }
+        }
+        if (segs == NULL) {
+            for(seg = shared_segment_list(); seg; seg = seg->next) {
+                if ((status = start_transaction_on_segment(seg)) != 0) {
+                    transaction_error_exit(0, status);
+                }
+            }
+        } else {
+            for (i = 0; i < n_segs; i++) {
+                if ((status = start_transaction_on_segment(segs[i])) != 0) {
+                    transaction_error_exit(0, status);
+                }
             }
         }
+    }
     
     if (push_transaction_stack(trans_name) != 0)
         transaction_error_exit(0, -1);
@@ -1057,189 +3722,343 @@ int _stm_start_transaction(char *trans_name) {
     return 0;
 }
 
+// For stm.hpp, when an exception leaves a transaction.  An outermost transaction is abandoned, and not retried.
+// A nested one is undone by itself if it is retryable, as in retry_nested_transaction(), so that the transaction
+// around it can catch the exception and go on.  If it can't be undone, or something the transactions around it
+// read has changed, the transaction around it is marked, and its commit fails with STM_ABANDONED_ERROR, or is
+// retried, unless the exception leaves it too.
+//
+void _stm_abandon_transaction() {
+    transaction_stack_element *trans = transaction_stack();
+    shared_segment *seg;
+    int32_t sequence;
+    int error;
+    
+    if (trans == NULL)
+        return;
+    if (trans->next == NULL) {
+        stm_abort_transaction(1);
+        return;
+    }
+    
+    error = trans->retryable ? 0 : STM_ABANDONED_ERROR;
+    for (seg = shared_segment_list(); seg && trans->retryable; seg = seg->next) {
+        if (seg->in_transaction && seg->n_nesting_marks > 0 &&
+            roll_back_nested_transaction(seg, &seg->nesting_marks[--seg->n_nesting_marks]) != 0)
+            error = STM_ABANDONED_ERROR;
+    }
+    for (seg = shared_segment_list(); seg && error == 0; seg = seg->next) {
+        if (seg->transaction_id == 0)
+            continue;
+        sequence = seg->segment_transaction_data->commit_sequence;
+        if (read_set_unchanged(seg))
+            seg->validated_sequence = sequence;
+        else
+            error = STM_COLLISION_ERROR;
+    }
+    
+    pop_transaction_stack();
+    if (error != 0 && transaction_stack()->abandoned != STM_ABANDONED_ERROR)
+        transaction_stack()->abandoned = error;
+}
+
+int _stm_start_transaction(char *trans_name) {
+    return _stm_start_transaction_on(trans_name, NULL, 0);
+}
+
+// Commits go as in TL2:  first every page the transaction wrote, on every segment, is locked, and each segment's
+// commit_sequence is bumped, and only then are the pages it only read checked.  Checked any earlier, a page we
+// read could be locked and changed by a transaction that read one of the pages we are about to lock, which would
+// check it before we locked it, and both transactions would commit, each missing the other's write.
+//
 // returns:
 //  0 - success
 // -1 - non-recoverable error
 //  1 - collision error:  should retry aborted transaction
 //
 static int lock_segment_pages(shared_segment *seg) {
-    snapshot_list_element *sl;
+    snapshot_element *sl;
     size_t page_num;
     page_table_element *page_table_elt;
+    int64_t word;
+    int written_pages = 0;
     
-    if (seg->transaction_id == 0) {
-        if (stm_verbose & 1)
-            fprintf(stderr, "lock_segment_pages:  segment should have active transaction, but doesn't\n");
-        return -1;
-    }
-
+    if (seg->transaction_id == 0)       // not touched in this transaction
+        return 0;
+    
+    if (seg->transaction_id == UNLOCKING_TRANSACTION_ID && seg->arena_used > 0)
+        seg->transaction_id = new_transaction_id(seg);
     
-    for (sl = seg->snapshot_list; sl; sl = sl->next) {
+    sort_snapshot_set(seg);     // so pages are locked in address order
+    
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+        
+        // Every page we wrote is locked, even if it turns out to be unchanged, so that whether it changed
+        // can be found out in the same pass over the page that writes it back.
+        
+        if (!sl->page_writable)
+            continue;
+        written_pages++;
         
         page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;         
         page_table_elt = &(seg->segment_page_table[page_num]);
+        word = read_page_word(page_table_elt);
+        if (page_owner(word) != 0 && page_owner(word) != seg->transaction_id && !seg->irrevocable)
+            word = wait_for_page_owner(seg, page_table_elt, word);
         
-        // even if this transaction is just reading a page, if any other transaction is writing into it,
-        // or has written into it, that is enough to make us abort. In that case we know the information 
-        // we are accessing is stale and therefore our results may be inconsistent with results of other transactions
+        // if any other transaction is writing into the page, or has written into it, that is enough to make us
+        // abort. In that case we know the information we are accessing is stale and therefore our results may be
+        // inconsistent with results of other transactions.  In merge mode, the page gets another chance once it
+        // is locked.
 
-        if (sl->snapshot_transaction_id != page_table_elt->completed_transaction) {
+        if (sl->snapshot_transaction_id != page_version(word) && !seg->merge_mode) {
             
             if (stm_verbose & 2)
                 fprintf(stderr, "lock_segment_pages: Transaction %d modified page %lx!\n",
-                        page_table_elt->completed_transaction, page_num);
+                        page_version(word), page_num);
             collision_histo[5]++;
+            note_page_contention(seg, page_table_elt, 1);
             set_stm_errno(STM_COLLISION_ERROR);
             return 1;
             
         }
         
         
-        if (page_table_elt->current_transaction != 0 &&
-            page_table_elt->current_transaction != seg->transaction_id) {
+        if (page_owner(word) != 0 && page_owner(word) != seg->transaction_id && !seg->irrevocable) {
             if (stm_verbose & 2)
                 fprintf(stderr, "lock_segment_pages: Transaction %d is modifying page %lx!\n",
-                        page_table_elt->current_transaction, page_num);
+                        page_owner(word), page_num);
             collision_histo[6]++;
-            set_stm_errno(STM_COLLISION_ERROR);            
+            note_page_contention(seg, page_table_elt, 1);
+            set_stm_errno(STM_BUSY_ERROR);            
             return 1;
         }   
         
-        if (memcmp(sl->original_page_snapshot, sl->original_page_va, seg->page_size) == 0)
-            continue;
-        
-        sl->page_dirty = 1;
-
-        // re-use the page snapshot buffer to temporarily keep a copy of the page so we can re-map the page as shared,
-        // then copy the new contents into it.
-        // *** If only there were page-remapping syscalls, I wouldn't have to do this copying - I could re-map the modified
-        // page out of the way, then re-map it into the right location in the file.  Better yet, if there were a way to associate
-        // a file region with a memory region (so the file is written into as opposed to read from) that would solve this.
-        
-        memcpy(sl->original_page_snapshot, sl->original_page_va, seg->page_size);   
-        
-        
 #ifdef OPTIMISTIC_LOCKING
         
-        if (atomic_compare_and_swap_32(0, seg->transaction_id,
-                                       (int32_t*)&(page_table_elt->current_transaction))) {
-            //              fprintf(stderr, "succeeded in locking page %x\n", page_num);
-        } else {    
+        // The lock is only taken if the page still has the version we just looked at, so that is the version
+        // of what we are about to write over.  A contended page may have been locked when we wrote it.  With
+        // the irrevocable token, a page locked early by somebody else is taken from them, and they find out
+        // when they try to commit.  Nobody else can change the version meanwhile.
+        
+        if (seg->irrevocable) {
+            while (page_owner(word) != seg->transaction_id &&
+                   !atomic_compare_and_swap_64(word, page_word(seg->transaction_id, page_version(word)),
+                                               &page_table_elt->page_word))
+                word = read_page_word(page_table_elt);
+        } else if (page_owner(word) != seg->transaction_id &&
+                   (page_owner(word) != 0 ||
+                    !atomic_compare_and_swap_64(word, page_word(seg->transaction_id, page_version(word)),
+                                                &page_table_elt->page_word))) {
             if (stm_verbose & 2)
                 fprintf(stderr, "lock_segment_pages: Race detected. Failed to lock page %lx\n", page_num);
             collision_histo[7]++;
-            set_stm_errno(STM_COLLISION_ERROR);            
+            note_page_contention(seg, page_table_elt, 1);
+            set_stm_errno(STM_BUSY_ERROR);            
             return 1;
         }       
         
-#endif
-                
-        if (page_table_elt->current_transaction != seg->transaction_id) {
+#else
+        
+        if (page_owner(word) != seg->transaction_id) {
             if (stm_verbose & 1) 
-                fprintf(stderr, "lock_segment_pages:  page %lx should already be locked by transaction %d, but is owned by %d\n",
-                        page_num, seg->transaction_id, page_table_elt->current_transaction);
+                fprintf(stderr, "lock_segment_pages:  page %lx should already be locked by transaction %d, "
+                        "but is owned by %d\n", page_num, seg->transaction_id, page_owner(word));
             set_stm_errno(STM_OWNERSHIP_ERROR);
             return -1;
         }
+        
+#endif
+        
+        doom_page_readers(seg, page_num);
 
-        if (sl->snapshot_transaction_id != page_table_elt->completed_transaction) {
+        if (sl->snapshot_transaction_id != page_version(word)) {
+            
+            // With the page locked, the shared view holds everything committed to it since our snapshot.  If
+            // none of that is in the lines we changed, writing back only our lines leaves both sets of changes.
+            
+            if (seg->merge_mode &&
+                !page_changes_overlap(sl->original_page_va,
+                                      seg->shared_view_va + (sl->original_page_va - seg->shared_base_va),
+                                      sl->original_page_snapshot, seg->page_size)) {
+                if (stm_verbose & 2)
+                    fprintf(stderr, "lock_segment_pages: merging changes of transaction %d into page %lx\n",
+                            page_version(word), page_num);
+                atomic_increment_32(&merged_pages);
+                continue;
+            }
             
             if (stm_verbose & 2)
                 fprintf(stderr, "lock_segment_pages: Transaction %d modified page %lx!\n",
-                        page_table_elt->completed_transaction, page_num);
+                        page_version(word), page_num);
             collision_histo[8]++;
+            note_page_contention(seg, page_table_elt, 1);
             set_stm_errno(STM_COLLISION_ERROR);
             return 1;           
         }       
     }
     
+    // Readers must know to revalidate before anything changes under them, so the commit sequence is bumped now,
+    // whether or not any page turns out to be dirty.  With the version clock, this is also the pages' new version.
+    
+    if (written_pages > 0)
+        seg->commit_version = atomic_increment_32(&seg->segment_transaction_data->commit_sequence);
+    return 0;
+}
+
+// Check the pages we only read, once every page we wrote is locked.  Even if this transaction is just reading a
+// page, if any other transaction is writing into it, or has written into it, that is enough to make us abort.
+// Nobody is waited for here:  whoever has the page locked may be waiting on a page we have locked.
+//
+// returns:
+//  0 - success
+//  1 - collision error:  should retry aborted transaction
+//
+static int validate_read_pages(shared_segment *seg) {
+    snapshot_element *sl;
+    size_t page_num;
+    page_table_element *page_table_elt;
+    int64_t word;
+    
+    if (seg->transaction_id == 0)       // not touched in this transaction
+        return 0;
+    
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
+        if (sl->page_writable)
+            continue;
+        
+        page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;
+        page_table_elt = &(seg->segment_page_table[page_num]);
+        word = read_page_word(page_table_elt);
+        
+        if (sl->snapshot_transaction_id != page_version(word)) {
+            if (stm_verbose & 2)
+                fprintf(stderr, "validate_read_pages: Transaction %d modified page %lx!\n",
+                        page_version(word), page_num);
+            collision_histo[5]++;
+            note_page_contention(seg, page_table_elt, 0);
+            set_stm_errno(STM_COLLISION_ERROR);
+            return 1;
+        }
+        
+        if (page_owner(word) != 0 && page_owner(word) != seg->transaction_id && !seg->irrevocable) {
+            if (stm_verbose & 2)
+                fprintf(stderr, "validate_read_pages: Transaction %d is modifying page %lx!\n",
+                        page_owner(word), page_num);
+            collision_histo[6]++;
+            note_page_contention(seg, page_table_elt, 0);
+            set_stm_errno(STM_BUSY_ERROR);
+            return 1;
+        }
+    }
     return 0;
 }
 
 
+static stm_commit_trace_fn commit_trace;
+
+void stm_set_commit_trace(stm_commit_trace_fn trace) {
+    commit_trace = trace;
+}
+
+// Report the runs of changed cache lines in a page that has just been written back.
+//
+static void trace_changed_lines(shared_segment *seg, snapshot_element *sl) {
+    size_t n_lines = seg->page_size / PAGEOPS_LINE;
+    size_t line, first, offset = sl->original_page_va - seg->shared_base_va;
+    
+#define line_changed(n) ((sl->changed_lines[(n)/64] >> ((n)%64)) & 1)
+    
+    for (line = 0; line < n_lines; ) {
+        if (!line_changed(line)) {
+            line++;
+            continue;
+        }
+        for (first = line; line < n_lines && line_changed(line); line++)
+            ;
+        commit_trace(seg, seg->transaction_id, offset + first * PAGEOPS_LINE,
+                     seg->shared_view_va + offset + first * PAGEOPS_LINE, (line - first) * PAGEOPS_LINE);
+    }
+    
+#undef line_changed
+}
+
+
 static int write_locked_segment_pages(shared_segment *seg) {
     
-    snapshot_list_element *sl;
-    void *status;
+    snapshot_element *sl;
     size_t page_num;
     int result = 0;
+    int written_pages = 0;
+    int keep_warm;
     
     page_table_element *page_table_elt;
     
-        
-    // Re-map shared.
-        
-
-    status = mmap(seg->shared_base_va, seg->shared_seg_size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_SHARED, seg->fd,
-                  (off_t)0);
-    if (status == (void*)-1) {
-        if (stm_verbose & 1)
-            perror("write_locked_pages: mmap error");
-        set_stm_errno(STM_MMAP_ERROR);
-        return -1;
+    seg->in_transaction = 0;
+    if (seg->transaction_id == 0) {     // not touched in this transaction
+        release_admission(seg, -1);
+        return 0;
     }
     
     if (stm_verbose & 4)
         fprintf(stderr, "Transaction %d [", seg->transaction_id);
     
-    // now copy the new versions of the dirty pages into the shared, mapped file.
+    // now copy the new versions of the pages we wrote into the shared, mapped file, through the segment's shared
+    // view.  Only the cache lines that changed are written, and we find out as we go which pages really changed.
     
-    for (sl = seg->snapshot_list; sl; sl = sl->next) {
+    for (sl = seg->snapshots; sl < seg->snapshots + seg->n_snapshots; sl++) {
         
         page_num = (sl->original_page_va - seg->shared_base_va)/seg->page_size;     
         page_table_elt = &(seg->segment_page_table[page_num]);
         
+        if (sl->page_writable) {
+            
+            written_pages++;
+            sl->page_dirty = page_diff_copy(seg->shared_view_va + (sl->original_page_va - seg->shared_base_va),
+                                            sl->original_page_va, sl->original_page_snapshot, seg->page_size,
+                                            sl->changed_lines,
+                                            seg->arena_used * seg->page_size > STM_NONTEMPORAL_THRESHOLD) != 0;
+        }
+        
         if (sl->page_dirty) {
                         
             if (stm_verbose & 4)
                 fprintf(stderr, " %lx", page_num);
-
-            page_table_elt->completed_transaction = seg->transaction_id;
-            
-            // copy the temporarily saved, modified pages back into the right places
-            //
-            memcpy(sl->original_page_va, sl->original_page_snapshot, seg->page_size);
             
-        }
-                
-        if (page_table_elt->current_transaction == seg->transaction_id) {
-            // Only release pages owned by this transaction!
-            // Pages that were only read and not modified by this transaction will not be marked as
-            // associated with this transaction under optimistic locking. They may even be
-            // associated with another transaction.
+            note_page_committed(seg, page_table_elt);
             
-            page_table_elt->current_transaction = 0;    
+            if (commit_trace)
+                trace_changed_lines(seg, sl);
         }
+        
+        unlock_page(seg, page_table_elt, sl->page_dirty,
+                    (seg->validation == STM_VALIDATE_VERSION_CLOCK) ?
+                    (transaction_id_t)seg->commit_version : seg->transaction_id);
     }
     
     if (stm_verbose & 4)
         fprintf(stderr, " ]\n");
 
-    // re-protect the segment to be whatever it is supposed to be between transactions
-
+    // drop our private copies, and re-protect the segment to be whatever it is supposed to be between transactions,
+    // except for the pages we only read, if the segment is readable between transactions anyway and there aren't
+    // too many of them.  If we wrote nothing, there is then nothing to do.
     
-#ifdef PRIVATE_MAPPING_IS_PRIVATE    
-    if (seg->default_prot_flags != (PROT_READ|PROT_WRITE))
-        status = (void*)(long)mprotect(seg->shared_base_va, seg->shared_seg_size, seg->default_prot_flags);
-    else
-        status = 0;
-
-#else    
+    keep_warm = (seg->default_prot_flags & PROT_READ) && seg->n_snapshots - written_pages <= STM_WARM_PAGES;
     
-    status = mmap(seg->shared_base_va, seg->shared_seg_size, seg->default_prot_flags, MAP_FIXED|MAP_PRIVATE, seg->fd, 
-                    (off_t)0);
-
-#endif
-    if (status == (void*)-1) {
+    if (restore_segment_pages(seg, keep_warm) != 0) {
         perror("write_locked_segment_pages: mmap error");
         set_stm_errno(STM_MMAP_ERROR);
         result = -1;
     }
     
-    free_snapshot_list(seg);
+    if (keep_warm && result == 0)
+        keep_warm_pages(seg);
+    else
+        clear_snapshot_set(seg);
     
     delete_active_transaction(seg);
     seg->transaction_id = 0;
+    release_admission(seg, 1);
     
     return result;
     
@@ -1247,6 +4066,7 @@ static int write_locked_segment_pages(shared_segment *seg) {
 
 
 int stm_commit_transaction(char *trans_name) {
+    transaction_stack_element *trans;
     shared_segment *seg;
     int result = 0;
     
@@ -1273,6 +4093,15 @@ int stm_commit_transaction(char *trans_name) {
         transaction_error_exit(STM_TRANS_STACK_ERROR, -1);
     }
     
+    // A nested transaction that was abandoned leaves its mark on the one around it, out to the outermost, which
+    // fails.  A collision is retried as usual.
+    
+    trans = transaction_stack();
+    if (trans->abandoned && trans->next == NULL)
+        transaction_error_exit(trans->abandoned, trans->abandoned == STM_COLLISION_ERROR ? 1 : -1);
+    if (trans->abandoned && trans->next->abandoned != STM_ABANDONED_ERROR)
+        trans->next->abandoned = trans->abandoned;
+    
     if (transaction_stack()->next == NULL) {
         // only actually commit on outermost transaction.
         
@@ -1290,6 +4119,8 @@ int stm_commit_transaction(char *trans_name) {
         }
         
 
+        enter_commit_gate();
+        
         for(seg = shared_segment_list(); seg; seg = seg->next) {
             if ((result = lock_segment_pages(seg)) != 0) {
                 // if there is a failure on any shared segment, abort on all segments
@@ -1297,7 +4128,10 @@ int stm_commit_transaction(char *trans_name) {
             }
         }
         
-        
+        for(seg = shared_segment_list(); seg; seg = seg->next) {
+            if ((result = validate_read_pages(seg)) != 0)
+                transaction_error_exit(0, result);
+        }
         
         for(seg = shared_segment_list(); seg; seg = seg->next) {
             if ((result = write_locked_segment_pages(seg)) != 0) {
@@ -1308,6 +4142,10 @@ int stm_commit_transaction(char *trans_name) {
         
         // At this point, it's really too late to reverse anything...
         
+        leave_commit_gate();
+        for(seg = shared_segment_list(); seg; seg = seg->next)
+            release_irrevocable_token(seg);
+        
         // if (sigprocmask(SIG_SETMASK, &saved_signals, NULL) == -1) {
         if (pthread_sigmask(SIG_SETMASK, &saved_signals, NULL) == -1) {
             if (stm_verbose & 1)
@@ -1315,6 +4153,8 @@ int stm_commit_transaction(char *trans_name) {
             set_stm_errno(STM_SIGNAL_ERROR);
             result = -1;
         }                       
+    } else if (transaction_stack()->retryable) {
+        commit_nested_transaction();
     }
     
     pop_transaction_stack();
@@ -1326,12 +4166,22 @@ int stm_commit_transaction(char *trans_name) {
 void stm_close_shared_segment(shared_segment *seg) {
     shared_segment *s, *prev;
     
+    release_admission(seg, seg->transaction_id ? 0 : -1);
     if (seg->transaction_id)
         abort_transaction_on_segment(seg);
+    release_irrevocable_token(seg);
+    
+#ifdef HAVE_USERFAULTFD
+    if (seg->engine == STM_ENGINE_USERFAULTFD)
+        unregister_uffd_segment(seg);
+#endif
     
     if (seg->shared_base_va)
         munmap(seg->shared_base_va, seg->shared_seg_size);
     
+    if (seg->shared_view_va)
+        munmap(seg->shared_view_va, seg->shared_seg_size);
+    
     if (seg->segment_transaction_data)
         munmap(seg->segment_transaction_data, seg->transaction_data_size);
     
@@ -1353,7 +4203,9 @@ void stm_close_shared_segment(shared_segment *seg) {
     
     if (seg->filename) free(seg->filename);
     if (seg->metadata_filename) free(seg->metadata_filename);
-    free_snapshot_pool(seg);
+    free_snapshot_set(seg);
+    if (seg->granted_ranges) free(seg->granted_ranges);
+    if (seg->prior_active_transactions) free(seg->prior_active_transactions);
     
     free(seg);
 }
@@ -63,6 +63,87 @@ int stm_init(int verbose);
 void stm_init_thread_locals();
 
 
+/*
+ stm_set_fault_engine() selects how accesses to shared segments are trapped during transactions, for
+ segments opened after the call.  Segments already open keep the engine they were opened with.
+ 
+ Args:
+ engine     STM_ENGINE_SIGNAL         page protection and a signal handler for the page access signal
+                                      (the default, and the only engine on systems other than Linux).
+            STM_ENGINE_USERFAULTFD    Linux userfaultfd(2), with write protection.  Faults are handled by a
+                                      thread of our own instead of a signal handler, and no mprotect()
+                                      or mmap() calls are made at transaction start or end.
+                                      The segment is private memory between transactions:  writes made outside
+                                      a transaction are never seen by other processes, and never reach the
+                                      file, and pages read outside a transaction do not see commits made after
+                                      they were first touched.  Make changes meant to be shared in transactions.
+                                      A child process has to open the segments it uses itself:  the ones it
+                                      inherits are no longer watched.
+ 
+ Return value:
+  0         success
+ -1         failure (the engine is not available here), stm_errno contains error code.
+ */
+int stm_set_fault_engine(int engine);
+
+#define STM_ENGINE_SIGNAL 0
+#define STM_ENGINE_USERFAULTFD 1
+
+
+/*
+ stm_set_registry_size() sets how many transactions can be active at once on a shared segment, counting all
+ threads of all processes, for segments whose metadata files are created after the call.  A segment whose
+ metadata file already exists keeps the size it was created with.  If the registry is full, a transaction
+ waits and retries until there is room.  The default is 1024.
+ 
+ Args:
+ max_active_transactions    the number of transactions; rounded up to a multiple of 64
+ */
+void stm_set_registry_size(int max_active_transactions);
+
+
+/*
+ stm_set_validation() selects how transactions on a shared segment find out that pages they have read were
+ changed by others, for segments whose metadata files are created after the call.  Every process using a segment
+ uses the scheme it was created with.
+ 
+ Args:
+ validation     STM_VALIDATE_TRANSACTION_IDS   each page records the ID of the last transaction to change it, and
+                                               each transaction registers itself as active and takes a snapshot of
+                                               the other active transactions when it starts (the default).
+                STM_VALIDATE_VERSION_CLOCK     a global version clock, advanced once by each commit that changes
+                                               anything, and each page records the time it was last changed.  A
+                                               transaction notes the time it starts, and only has to check that
+                                               pages have not changed since.  No active transactions are
+                                               registered, and a transaction that only reads writes nothing shared.
+ 
+ Return value:
+  0         success
+ -1         failure, stm_errno contains error code.
+ */
+int stm_set_validation(int validation);
+
+#define STM_VALIDATE_TRANSACTION_IDS 0
+#define STM_VALIDATE_VERSION_CLOCK 1
+
+
+/*
+ stm_set_visible_readers() turns on visible readers for segments whose metadata files are created after the
+ call.  A transaction that reads a page marks it, and a transaction that is about to commit changes to a page
+ flags the active transactions that have marked it as doomed.  Whenever another transaction has committed since a
+ transaction last checked the pages it has read, which it does at every fault, it only has to look through them
+ if it has been flagged, so long transactions that read many pages don't spend their time rechecking them, and a
+ doomed one finds out at its next fault.  Marks are kept per page a bit for each of 64 groups of active
+ transactions, so a transaction is occasionally flagged when it did not read the page, and then just checks its
+ pages as usual.  Only used with STM_VALIDATE_TRANSACTION_IDS.  The marks take 8 bytes per page of the segment at
+ the end of the metadata file, which are only there if the file was created with visible readers.
+ 
+ Args:
+ enable     1 for visible readers, 0 for none (the default)
+ */
+void stm_set_visible_readers(int enable);
+
+
 /* 
  Call stm_open_shared_segment() to open a shared memory segment in each process that wants to access it.
  You can have as many shared areas as you like.  You specify a file that is shared among all
@@ -79,7 +160,10 @@ void stm_init_thread_locals();
  requested_va   If NULL, the shared segment will be allocated at will.  If specified, the address where you would
                 like your shared segment.
  prot_flags     Either PROT_NONE, or the binary OR of PROT_READ and PROT_WRITE (or just one of them).
-                Controls access to shared segment between transactions.
+                Controls access to shared segment between transactions.  With PROT_READ, pages the last
+                committed transaction only read stay readable, and the next transaction checks at its start that
+                they haven't changed, rather than faulting on them again.  With the userfaultfd engine, writes
+                between transactions stay in this process; see stm_set_fault_engine().
  
  Return value:
  NULL           failure; stm_error contains error code.
@@ -97,11 +181,21 @@ struct shared_segment *stm_open_shared_segment(char *filename, size_t size, void
  have written into any page you read from during the transaction) or else the transaction will abort 
  and retry.  (You should design transactions to be short, have no other side effects (like I/O), and be restartable!).
  Transactions can be nested.  Only the outermost transaction actually commits changes when it is done.
- This allows transactions to be built up of other transactions.
+ This allows transactions to be built up of other transactions.  A conflict over a page that a nested
+ transaction touched first, while it is still going, retries just the nested transaction, as long as what
+ the transactions around it have read is still as it was; see stm_set_closed_nesting().
  The name you provide must match the name in the matching commit.
+ A shared segment only takes part in a transaction once it is first touched in it, so segments a transaction
+ doesn't use cost it nothing.
  
- Argument:
+ stm_start_transaction_on() starts a transaction that can touch only the given segments.  The others are left
+ as they are between transactions, so accesses to them are unsynchronized and take effect immediately.  For a
+ nested transaction, the segments given to the outermost one are the ones that count.
+ 
+ Arguments:
  trans_name     name-tag for this transaction.  Cannot be NULL.  Must match name in corresponding commit.
+ segs           (stm_start_transaction_on only) array of pointers to shared_segments
+ n_segs         (stm_start_transaction_on only) number of segments in segs
  
  Return value:
   0             success
@@ -111,27 +205,211 @@ struct shared_segment *stm_open_shared_segment(char *filename, size_t size, void
 /*
  Call this macro, not the internal function it calls.  This is what enables transaction restarts.
  */
-#define stm_start_transaction(trans_name) \
-{   if (_stm_transaction_stack_empty()) {\
-        int _status_, _delay_ = STM_MIN_DELAY;\
-        struct timespec _ts_;\
-        if ((_status_ = setjmp(*stm_jmp_buf())) > 0) {\
-            _ts_.tv_sec = 0;\
-            _ts_.tv_nsec = _delay_;\
-            nanosleep(&_ts_, NULL);\
-            _delay_ += _delay_>>2;\
+#define stm_start_transaction(trans_name) stm_start_transaction_on(trans_name, NULL, 0)
+
+#define stm_start_transaction_on(trans_name, segs, n_segs) \
+{   sigjmp_buf * volatile _jmp_buf_ = _stm_retry_jmp_buf();\
+    if (_jmp_buf_ != NULL) {\
+        int _status_;\
+        if ((_status_ = sigsetjmp(*_jmp_buf_, 1)) > 0) {\
+            _stm_contention_retry(trans_name, 0, 0);\
         } else if (_status_ < 0) {\
             exit (-1);\
+        } else if (_stm_transaction_stack_empty()) {\
+            _stm_contention_start(0);\
         }\
     }\
-    _stm_start_transaction(trans_name);\
+    _stm_start_transaction_on(trans_name, segs, n_segs);\
 }
 
 
+/*
+ stm_start_transaction_limited() is like stm_start_transaction(), except that it doesn't retry forever, and
+ doesn't exit on errors.  Instead it sets status to something other than 0, and doesn't start the transaction:
+ so check status after it, and only go on with the transaction, and commit it, if status is 0.  The limits are
+ counted from the first attempt, and apply to the outermost transaction.
+ 
+ Arguments:
+ trans_name     name-tag for this transaction, as for stm_start_transaction()
+ segs, n_segs   (stm_start_transaction_limited_on only) as for stm_start_transaction_on()
+ max_attempts   give up after this many attempts have been aborted, or 0 for no limit
+ timeout        give up if the next attempt can't start within this many nanoseconds of the first one, or 0
+                for no limit
+ status         an int variable, which is set to:
+  0             the transaction has started
+  1             the transaction was given up on:  stm_errno is STM_RETRY_LIMIT_ERROR, and stm_abort_reason()
+                says why the last attempt was aborted
+ -1             failure, stm_errno contains error code.
+ */
+#define stm_start_transaction_limited(trans_name, max_attempts, timeout, status) \
+    stm_start_transaction_limited_on(trans_name, NULL, 0, max_attempts, timeout, status)
+
+#define stm_start_transaction_limited_on(trans_name, segs, n_segs, max_attempts, timeout, status) \
+{   sigjmp_buf * volatile _jmp_buf_ = _stm_retry_jmp_buf();\
+    (status) = 0;\
+    if (_jmp_buf_ != NULL) {\
+        int _status_;\
+        if ((_status_ = sigsetjmp(*_jmp_buf_, 1)) > 0) {\
+            (status) = _stm_contention_retry(trans_name, max_attempts, timeout);\
+        } else if (_status_ < 0) {\
+            (status) = -1;\
+        } else if (_stm_transaction_stack_empty()) {\
+            _stm_contention_start(timeout);\
+        }\
+    }\
+    if ((status) == 0 && _stm_start_transaction_on(trans_name, segs, n_segs) != 0)\
+        (status) = -1;\
+}
+
+/*
+ Returns why the thread's last transaction attempt to be aborted was aborted:  the value stm_errno had then,
+ such as STM_COLLISION_ERROR.
+ */
+int stm_abort_reason();
+
+
 // Things needed when the above macro expands:
+// (The signal mask is saved with the context because transactions are restarted from inside the signal
+// handler, and from inside the commit, which blocks signals.)
 //
-#define STM_MIN_DELAY 10
-jmp_buf *stm_jmp_buf();
+sigjmp_buf *stm_jmp_buf();
+sigjmp_buf *_stm_retry_jmp_buf();
+void _stm_contention_start(long timeout);
+int _stm_contention_retry(char *trans_name, int max_attempts, long timeout);
+
+
+/*
+ When a transaction has to be retried, a contention manager decides how long it waits first.  It is given what
+ is known about the transaction's attempts so far, and returns a number of nanoseconds, or 0 to retry at once.
+ Short waits are spent yielding the processor rather than asleep.
+ 
+ The built-in contention managers:
+ stm_cm_backoff     exponential backoff, from STM_MIN_DELAY up to at most STM_MAX_DELAY, with random jitter.
+                    After the first conflict over pages read, the transaction that caused it has already
+                    committed, so the first retry for that reason is immediate.  This is the default.
+ stm_cm_timestamp   older transactions win:  the longer a transaction has been trying, the less it waits, while
+                    newer ones back off as usual.
+ stm_cm_karma       transactions that have done more work win:  the more pages a transaction's attempts have
+                    touched in all, the less it waits.
+ stm_cm_polite      never sleeps, but yields for a short, growing while, for transactions that are short and
+                    cheap to retry.
+ All of them back off as stm_cm_backoff does when the registry is full, since only time helps then.
+ */
+typedef struct stm_contention {
+    char *trans_name;       // the transaction being retried
+    int reason;             // why it was aborted:  STM_COLLISION_ERROR if pages it read were changed, STM_BUSY_ERROR
+                            // if a page it needed was locked by another transaction's commit, or
+                            // STM_REGISTRY_FULL_ERROR
+    int retries;            // how many times it has been retried, counting this time
+    long age;               // nanoseconds since its first attempt started
+    long karma;             // pages touched by all its attempts so far
+} stm_contention;
+
+typedef long (*stm_contention_manager)(stm_contention *c);
+
+long stm_cm_backoff(stm_contention *c);
+long stm_cm_timestamp(stm_contention *c);
+long stm_cm_karma(stm_contention *c);
+long stm_cm_polite(stm_contention *c);
+
+#define STM_MIN_DELAY 1000
+#define STM_MAX_DELAY 1000000
+
+/*
+ stm_set_contention_manager() sets the contention manager for the transactions with a given name, or with a NULL
+ name, for all those that don't have one of their own.  The built-in ones above may be used, or one of your
+ own.  Set them up before any threads start transactions.
+ 
+ Args:
+ trans_name     name of the transactions, as given to stm_start_transaction(), or NULL
+ cm             the contention manager, or NULL for the default
+ 
+ Return value:
+  0         success
+ -1         failure, stm_errno contains error code.
+ */
+int stm_set_contention_manager(char *trans_name, stm_contention_manager cm);
+
+
+/*
+ An irrevocable transaction is one that can't be aborted by conflicts with other transactions, so it can do
+ things that can't be undone, like I/O.  While it runs, it holds a token on each of the shared segments it can
+ touch, and no other transaction can start on those segments, or commit changes to them, until it is done.
+ Whatever other transactions had started carry on until they commit.  So only one irrevocable transaction
+ runs at a time on a segment, and it holds up everything else, which is fine for the occasional transaction
+ that must not fail.
+ 
+ stm_become_irrevocable() makes the current transaction irrevocable from here on.  If pages it has read so far
+ have been changed, it is retried first, as irrevocable from the start.  Call it before doing anything that
+ can't be undone.
+ 
+ Return value:
+  0         success
+ -1         failure (no transaction), stm_errno contains error code.
+ */
+int stm_become_irrevocable();
+
+/*
+ stm_set_irrevocable_after() sets when a transaction that keeps being aborted becomes irrevocable, so that it
+ can't be starved by other transactions:  after it has been retried a given number of times, or has been trying
+ for a given number of nanoseconds, whichever comes first.  0 for either means never for that reason.  The
+ default is 100 retries or 100 milliseconds.
+ 
+ Args:
+ retries        number of retries
+ nanoseconds    time since the first attempt started
+ */
+void stm_set_irrevocable_after(int retries, long nanoseconds);
+
+/*
+ stm_set_eager_threshold() sets how contended a page has to be before it is locked as soon as a transaction
+ writes it, rather than when the transaction commits.  Each page's contention goes up by 4, to at most 32, each
+ time a transaction writing it is aborted because another transaction wrote it; conflicts with transactions that
+ only read it don't count.  It goes down by 1 each time a transaction commits a change to it, and by 1 for every
+ 16 commits to the segment since it last went up.  The default is 8.  0 means pages are only ever locked at
+ commit.  A transaction reading a page that may have been locked early doesn't wait for it to be unlocked.
+ 
+ Args:
+ threshold      the contention at which pages are locked early
+ */
+void stm_set_eager_threshold(int threshold);
+
+/*
+ stm_set_admission_control() turns admission control on or off for the calling process.  With it on, the number
+ of transactions writing a segment at once is limited, and the limit is lowered when many of them are being
+ aborted, and raised again as they stop being aborted.  A transaction that would go over the limit waits when it
+ first writes the segment, for up to 10 milliseconds; transactions that only read are never held up.
+ 
+ Args:
+ enable         nonzero to turn it on, 0 to turn it off (the default)
+ */
+void stm_set_admission_control(int enable);
+
+/*
+ stm_set_closed_nesting() turns on or off, for the calling process, retrying nested transactions by themselves.
+ With it on, which is the default, each nested transaction keeps track of the pages it first touched, and keeps
+ copies of pages written before it started, as they were when it started, the first time it writes them.
+ That costs something at the start of a nested transaction, and on its first write to each such page.  Only
+ segments using the version clock (see stm_set_validation()) can have nested transactions retried, since a
+ transaction ID fixes the point in the order of transactions that the transaction has to be consistent with.
+ 
+ Args:
+ enable         nonzero to turn it on, 0 to turn it off
+ */
+void stm_set_closed_nesting(int enable);
+
+/*
+ stm_retry() gives up on the current transaction until another transaction commits a change to a page it has
+ read, and then starts it again, from the outermost stm_start_transaction().  It is for a transaction that finds
+ nothing to do, like a consumer finding a shared queue empty:  rather than polling, the thread sleeps until
+ whatever it looked at changes.  A transaction that has read nothing is started again right away.  In a
+ transaction started with stm_start_transaction_limited(), the wait ends at the timeout, and the transaction is
+ then given up on.  Waiting doesn't count as an attempt, or as an abort for admission control.
+ 
+ Return value:
+ -1         failure (no transaction), stm_errno contains error code.  Otherwise it doesn't return.
+ */
+int stm_retry();
 
 
 
@@ -194,6 +472,69 @@ size_t stm_segment_size(struct shared_segment *seg);
 size_t stm_page_size(struct shared_segment *seg);
 
 
+/*
+ Each shared segment has an arena of page-aligned buffers for the snapshots taken of pages as they are first
+ written in a transaction.  stm_set_snapshot_arena() controls how much of it stays allocated between transactions.
+ 
+ Args:
+ seg        pointer to shared_segment, as provided by stm_open_shared_segment
+ high_water Number of bytes of snapshot buffers to keep between transactions (rounded up to whole pages).
+            Buffers used beyond this by a large transaction are given back to the kernel when it ends.
+ flags      0, or STM_SNAPSHOT_HUGEPAGES to ask for the arena to be backed by huge pages where possible.
+ 
+ Return value:
+  0         success
+ -1         failure, stm_errno contains error code.
+ */
+int stm_set_snapshot_arena(struct shared_segment *seg, size_t high_water, int flags);
+
+#define STM_SNAPSHOT_HUGEPAGES 1
+
+
+/*
+ Conflicts between transactions are normally found a page at a time, so two processes updating different records
+ on the same page abort each other.  In merge mode, when a page this process has written was also changed by a
+ transaction that committed in the meantime, the commit compares the two sets of changes a cache line (64 bytes)
+ at a time, and if they don't overlap, writes just its own lines in among the other transaction's and succeeds.
+
+ Merge mode gives up serializability on the pages a transaction writes.  The library can't see which bytes of a
+ page a transaction read, so nothing checks that the lines it read there and didn't change are still as they
+ were when it commits:  it can commit having acted on a line that another transaction changed meanwhile, so
+ that the two transactions have no order in which they could have run one after the other.  It is only safe
+ if, on a page it writes, a transaction reads only the cache lines it also changes, or doesn't care if the rest
+ of the page changes underneath it.  Records that are updated independently should be aligned to cache lines.
+ Pages that a transaction only reads are still checked as a whole.
+
+ Args:
+ seg        pointer to shared_segment, as provided by stm_open_shared_segment
+ enable     1 to turn merge mode on for this process's transactions on the segment, 0 to turn it off (the default)
+
+ Return value:
+  0         success
+ */
+int stm_set_merge_mode(struct shared_segment *seg, int enable);
+
+
+/*
+ stm_set_commit_trace() installs a function to be called as each transaction commits, once for every run of
+ changed bytes written into a shared segment, for tracing or replication.  Changes are tracked a cache line at a
+ time, so a run may include bytes that did not change.  The function is called while the pages are still
+ locked against other transactions and with signals blocked, so it should be quick, and must not access any
+ shared segment except through the data pointer it is given.  Pass NULL to stop tracing.
+ 
+ Args to the trace function:
+ seg        the shared segment
+ trans_id   ID of the committing transaction (new versions of the same pages have higher IDs)
+ offset     offset of the run from the start of the segment
+ data       the committed contents of the run
+ length     length of the run in bytes
+ */
+typedef void (*stm_commit_trace_fn)(struct shared_segment *seg, transaction_id_t trans_id, size_t offset,
+                                    const void *data, size_t length);
+
+void stm_set_commit_trace(stm_commit_trace_fn trace);
+
+
 /*
  Returns the file descriptor associated with an open shared memory segment.
  */
@@ -218,6 +559,13 @@ int stm_errno();       // on errors, this variable will contain one of the follo
 #define STM_WRITE_ERROR 10
 #define STM_TRANS_STACK_ERROR 11
 #define STM_OWNERSHIP_ERROR 12
+#define STM_ENGINE_ERROR 13
+#define STM_REGISTRY_FULL_ERROR 14
+#define STM_VALIDATION_ERROR 15
+#define STM_BUSY_ERROR 16           // like STM_COLLISION_ERROR, but a page was locked by another transaction
+#define STM_RETRY_LIMIT_ERROR 17    // stm_start_transaction_limited() gave up
+#define STM_RETRY_ERROR 18          // the transaction called stm_retry()
+#define STM_ABANDONED_ERROR 19      // a nested stm::atomically() threw, and what it did couldn't be undone
 
 
 
@@ -241,10 +589,13 @@ void stm_set_free_list_addr(struct shared_segment *seg, void **free_list_addr);
 
 /*
  These are really private functions so do not call them directly.  They have to be exposed for use by the
- above macro.
+ above macros, and by stm.hpp.
  */
 int _stm_transaction_stack_empty();
 int _stm_start_transaction(char *trans_name);
+int _stm_start_transaction_on(char *trans_name, struct shared_segment **segs, int n_segs);
+int _stm_contention_retry_with(char *trans_name, int max_attempts, long timeout, stm_contention_manager cm);
+void _stm_abandon_transaction();
 
 
 
@@ -0,0 +1,203 @@
+/*
+ 
+ stm.hpp
+ 
+ C++ interface to stm.c.  stm::atomically() runs a function, usually a lambda, as a transaction, and returns what
+ it returns, retrying it as often as it takes.  It takes the place of the stm_start_transaction() and
+ stm_commit_transaction() macros, for C++ programs:
+ 
+     long n = stm::atomically([&] { return ++counter->value; });
+ 
+ The context a transaction restarts from is saved inside stm::atomically(), so nothing in the calling function
+ is clobbered by a restart, and there are no names to match.  A transaction is still restarted by a longjmp out
+ of wherever it was when the conflict was found, though, so objects created in the function that need their
+ destructors run (to free memory, say) shouldn't be alive across an access to a shared segment.  They are
+ simply abandoned when the transaction restarts.
+ 
+ Copyright 2009 Shel Kaphan
+ 
+ This file is part of stmmap.
+ 
+ stmmap is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ stmmap is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with stmmap.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef STM_HPP
+#define STM_HPP
+
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+extern "C" {
+#include "stm.h"
+}
+
+
+namespace stm {
+
+/*
+ Thrown by stm::atomically() when a transaction can't be done:  when its policy gave up on it (code() is
+ STM_RETRY_LIMIT_ERROR), or on a serious error, with code() the value of stm_errno.  Conflicts are never
+ reported this way; they just cause a retry.
+ */
+class error : public std::runtime_error {
+public:
+    explicit error(int code) : std::runtime_error("stm transaction failed"), code_(code) {}
+    int code() const { return code_; }
+private:
+    int code_;
+};
+
+/*
+ A policy says how hard stm::atomically() tries, as for stm_start_transaction_limited(), and which contention
+ manager decides how long it waits before each retry.
+ 
+ Args:
+ MaxAttempts        give up after this many attempts, or 0 for never
+ Timeout            give up when the next attempt couldn't start within this many nanoseconds of the first,
+                    or 0 for never
+ ContentionManager  one of the contention managers in stm.h, or one of your own, or NULL for the one set for
+                    all transactions with stm_set_contention_manager()
+ */
+template <int MaxAttempts = 0, long Timeout = 0, stm_contention_manager ContentionManager = nullptr>
+struct policy {
+    static const int max_attempts = MaxAttempts;
+    static const long timeout = Timeout;
+    static stm_contention_manager contention_manager() { return ContentionManager; }
+    static char *name() { return const_cast<char *>("stm::atomically"); }
+};
+
+typedef policy<> default_policy;
+
+
+namespace detail {
+
+// Where a transaction's result is kept until it commits.  Each attempt that gets as far as the commit replaces
+// what the last one left.
+//
+template <class T>
+class result {
+public:
+    result() : full_(false) {}
+    ~result() { clear(); }
+    void clear() {
+        if (full_)
+            value()->~T();
+        full_ = false;
+    }
+    template <class F>
+    void run(F &f) {
+        clear();
+        new (storage_) T(f());
+        full_ = true;
+    }
+    T take() { return std::move(*value()); }
+private:
+    T *value() { return reinterpret_cast<T *>(storage_); }
+    alignas(T) unsigned char storage_[sizeof(T)];
+    bool full_;
+};
+
+// A reference is kept as a pointer, to what the attempt that committed referred to.
+//
+template <class T>
+class result<T &> {
+public:
+    result() : value_(nullptr) {}
+    template <class F>
+    void run(F &f) { value_ = &f(); }
+    T &take() { return *value_; }
+private:
+    T *value_;
+};
+
+template <>
+class result<void> {
+public:
+    template <class F>
+    void run(F &f) { f(); }
+    void take() {}
+};
+
+// One transaction, attempted until it commits.  Returns 0, 1 if the policy gave up, or -1 on a serious error.
+// The context the transaction restarts from is saved in this frame, which stays put while the body runs, and
+// status is the only local that changes after it is saved.  An exception from the body abandons just this
+// transaction, and is passed on; see _stm_abandon_transaction() for what that does to the ones around it.
+//
+template <class Policy, class F, class T>
+int run(F &f, result<T> &r) {
+    sigjmp_buf *retry_buf = _stm_retry_jmp_buf();
+    volatile int status = 0;
+    int jumped;
+    
+    if (retry_buf != NULL) {
+        if ((jumped = sigsetjmp(*retry_buf, 1)) > 0)
+            status = _stm_contention_retry_with(Policy::name(), Policy::max_attempts, Policy::timeout,
+                                                Policy::contention_manager());
+        else if (jumped < 0)
+            status = -1;
+        else if (_stm_transaction_stack_empty())
+            _stm_contention_start(Policy::timeout);
+    }
+    if (status != 0)
+        return status;
+    
+    if (_stm_start_transaction(Policy::name()) != 0)
+        return -1;
+    try {
+        r.run(f);
+    } catch (...) {
+        _stm_abandon_transaction();
+        throw;
+    }
+    return stm_commit_transaction(Policy::name());
+}
+
+}   // namespace detail
+
+
+/*
+ stm::atomically() runs f() as a transaction, on all of the thread's shared segments, and returns what f returns.
+ If it conflicts with another transaction, f is run again, until it commits, or the policy gives up.  Within
+ another transaction, it is a nested transaction, which can be retried by itself; see stm_set_closed_nesting().
+ f may call stm_retry(), stm_become_irrevocable() and the like, as a transaction between the macros may.
+ 
+ Template args:
+ Policy         a stm::policy<>, or the default, which never gives up
+ 
+ Args:
+ f              the body of the transaction, callable with no arguments.  It may be run more than once.
+ 
+ Return value:
+ what f returned, from the attempt that committed.
+ 
+ Throws stm::error if the policy gave up, or on a serious error, and passes on any exception from f, having
+ abandoned the transaction.  Only this transaction is abandoned, so one around it can catch the exception and go
+ on:  with closed nesting, what f did is undone; without it, it can't be, and the transaction around it throws
+ stm::error with code() STM_ABANDONED_ERROR when it tries to commit.
+ */
+template <class Policy = default_policy, class F>
+auto atomically(F &&f) -> decltype(f()) {
+    detail::result<decltype(f())> r;
+    int status;
+    
+    if ((status = detail::run<Policy>(f, r)) != 0)
+        throw error(stm_errno());
+    return r.take();
+}
+
+}   // namespace stm
+
+#endif
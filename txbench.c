@@ -0,0 +1,267 @@
+/*
+
+ txbench.c
+
+ Micro-benchmarks of transactions, for the figures quoted when the features they measure went in:  the latency
+ of short transactions fighting over a few pages, with each contention manager; how long a transaction reading
+ a large segment takes while another process commits to it, with and without visible readers; and small
+ read-only transactions, with each fault engine, on segments readable between transactions and not.  Each runs
+ on a segment of its own, in processes it forks itself where it needs more than one.  Not part of the core
+ package.
+
+ Usage:  txbench [latency | readers | readonly ...]
+
+ Copyright 2009 Shel Kaphan
+
+ This file is part of stmmap.
+
+ stmmap is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ stmmap is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with stmmap.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stm.h"
+
+
+#define page_word(b, p) ((b)[(p) * 512])     // the first long of page p
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static struct shared_segment *new_segment(char *filename, size_t size, int prot_flags) {
+    char metadata_filename[256];
+    struct shared_segment *seg;
+
+    snprintf(metadata_filename, sizeof(metadata_filename), "%s.metadata", filename);
+    unlink(filename);
+    unlink(metadata_filename);
+    if ((seg = stm_open_shared_segment(filename, size, NULL, prot_flags)) == NULL) {
+        fprintf(stderr, "can't open %s: stm_errno %d\n", filename, stm_errno());
+        exit(-1);
+    }
+    return seg;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+//
+// Latency.  latency_processes processes each run latency_transactions transactions, each of which adds one to a
+// counter in each of two random pages of latency_pages, and reports the median and 99th percentile of the time
+// from the first attempt to the commit.
+//
+
+#define latency_processes 4
+#define latency_pages 8
+#define latency_transactions 2000
+
+static void count_latencies(char *cm_name, char *filename) {
+    static double latency[latency_transactions];
+    struct shared_segment *seg;
+    volatile long *b;
+    volatile double t;
+    volatile int j;
+    int p, q;
+
+    seg = stm_open_shared_segment(filename, latency_pages * 4096, NULL, PROT_NONE);
+    b = stm_segment_base(seg);
+    srandom(getpid());
+    for (j = 0; j < latency_transactions; j++) {
+        p = random() % latency_pages;
+        q = random() % latency_pages;
+        t = now();
+        stm_start_transaction("latency");
+        page_word(b, p) += 1;
+        page_word(b, q) += 1;
+        stm_commit_transaction("latency");
+        latency[j] = now() - t;
+    }
+    stm_close_shared_segment(seg);
+
+    qsort(latency, latency_transactions, sizeof(double), compare_doubles);
+    printf("%-16s pid %-8d p50 %8.1f us  p99 %8.1f us\n", cm_name, getpid(),
+           latency[latency_transactions / 2] * 1e6, latency[latency_transactions * 99 / 100] * 1e6);
+}
+
+static void bench_latency() {
+    static struct {
+        char *name;
+        stm_contention_manager cm;
+    } cms[] = {
+        { "stm_cm_backoff",     stm_cm_backoff },
+        { "stm_cm_timestamp",   stm_cm_timestamp },
+        { "stm_cm_karma",       stm_cm_karma },
+        { "stm_cm_polite",      stm_cm_polite },
+    };
+    char *filename = "/tmp/txbench-latency";
+    int i, k;
+
+    for (k = 0; k < (int)(sizeof(cms)/sizeof(cms[0])); k++) {
+        stm_close_shared_segment(new_segment(filename, latency_pages * 4096, PROT_NONE));
+        stm_set_contention_manager(NULL, cms[k].cm);
+        fflush(stdout);
+        for (i = 0; i < latency_processes; i++) {
+            if (fork() == 0) {
+                count_latencies(cms[k].name, filename);
+                fflush(stdout);
+                _exit(0);
+            }
+        }
+        while (wait(NULL) > 0)
+            ;
+    }
+    stm_set_contention_manager(NULL, NULL);
+}
+
+
+//
+// Visible readers.  One process reads every page of a readers_pages page segment but the first, in each of
+// readers_transactions transactions, while another commits to the first page as fast as it can.
+//
+
+#define readers_pages 4096
+#define readers_transactions 20
+
+static void bench_readers_with(int visible) {
+    char *filename = "/tmp/txbench-readers";
+    struct shared_segment *seg;
+    volatile long *b;
+    volatile double t;
+    volatile long sum;
+    volatile int j;
+    pid_t writer;
+    int p;
+
+    stm_set_visible_readers(visible);
+    stm_close_shared_segment(new_segment(filename, readers_pages * 4096, PROT_NONE));
+    stm_set_visible_readers(0);
+
+    fflush(stdout);
+    if ((writer = fork()) == 0) {
+        seg = stm_open_shared_segment(filename, readers_pages * 4096, NULL, PROT_NONE);
+        b = stm_segment_base(seg);
+        for (;;) {
+            stm_start_transaction("write");
+            page_word(b, 0) += 1;
+            stm_commit_transaction("write");
+        }
+    }
+
+    seg = stm_open_shared_segment(filename, readers_pages * 4096, NULL, PROT_NONE);
+    b = stm_segment_base(seg);
+    t = now();
+    for (j = 0; j < readers_transactions; j++) {
+        stm_start_transaction("read");
+        sum = 0;
+        for (p = 1; p < readers_pages; p++)
+            sum += page_word(b, p);
+        stm_commit_transaction("read");
+    }
+    t = now() - t;
+    kill(writer, SIGKILL);
+    waitpid(writer, NULL, 0);
+    stm_close_shared_segment(seg);
+
+    printf("%-16s %8.1f ms per reader transaction\n", visible ? "visible readers" : "invisible readers",
+           t * 1e3 / readers_transactions);
+}
+
+static void bench_readers() {
+    bench_readers_with(0);
+    bench_readers_with(1);
+}
+
+
+//
+// Read-only transactions.  readonly_transactions transactions in a row, each reading the first words of two
+// pages, with each fault engine that is available here.  On a PROT_READ segment, the pages stay warm between
+// transactions, and committing costs no system calls.
+//
+
+#define readonly_transactions 100000
+
+static void bench_readonly() {
+    static char *engines[] = { "signal", "userfaultfd" };
+    static int prots[] = { PROT_NONE, PROT_READ };
+    char *filename = "/tmp/txbench-readonly";
+    struct shared_segment *seg;
+    volatile long *b;
+    volatile long sum = 0;
+    volatile double t;
+    volatile long j;
+    volatile int k;
+    int engine;
+
+    for (engine = STM_ENGINE_SIGNAL; engine <= STM_ENGINE_USERFAULTFD; engine++) {
+        if (stm_set_fault_engine(engine) != 0)
+            continue;
+        for (k = 0; k < 2; k++) {
+            seg = new_segment(filename, 2 * 4096, prots[k]);
+            b = stm_segment_base(seg);
+            t = now();
+            for (j = 0; j < readonly_transactions; j++) {
+                stm_start_transaction("readonly");
+                sum += page_word(b, 0) + page_word(b, 1);
+                stm_commit_transaction("readonly");
+            }
+            t = now() - t;
+            stm_close_shared_segment(seg);
+            printf("%-16s %-10s %8.2f us per read-only transaction\n", engines[engine],
+                   prots[k] == PROT_NONE ? "PROT_NONE" : "PROT_READ", t * 1e6 / readonly_transactions);
+        }
+    }
+    stm_set_fault_engine(STM_ENGINE_SIGNAL);
+}
+
+
+struct {
+    char *name;
+    void (*fn)();
+} benches[] = {
+    { "latency",    bench_latency },
+    { "readers",    bench_readers },
+    { "readonly",   bench_readonly },
+};
+
+int main(int argc, char **argv) {
+    int i, j;
+
+    stm_init(0);
+
+    for (i = 0; i < (int)(sizeof(benches)/sizeof(benches[0])); i++) {
+        for (j = 1; j < argc && strcmp(argv[j], benches[i].name) != 0; j++)
+            ;
+        if (argc == 1 || j < argc)
+            benches[i].fn();
+    }
+
+    stm_close();
+    return 0;
+}